@@ -4,15 +4,28 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 // うまく設計されていて、各アルファベットの下５ケタはそのアルファベットに関連する制御文字に対応している。
@@ -22,6 +35,45 @@
 #define KILO_QUIT_TIMES 3
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+// 差分計算で探索する編集距離の上限。超えたら中間部分を丸ごと置き換える
+#define KILO_DIFF_MAX_D 1024
+// 冷えた行をまとめて圧縮するときの1ブロックの行数
+#define KILO_BLOCK_ROWS 64
+// 最後に触ってからこのキー入力回数が過ぎた行を冷えたとみなす
+#define KILO_COLD_AGE 256
+// 表示行の索引で1つの塊にまとめる行数。挿入で倍を超えたら塊を分ける
+#define KILO_WRAP_BLOCK 256
+// 括弧の索引で1つの葉にまとめる行数。挿入で倍を超えたら葉を分ける
+#define KILO_BRACKET_BLOCK 256
+// 補完候補の最大数
+#define KILO_COMPLETE_MAX 16
+// 単語の索引に一度に併合する新しい単語の数と、併合で一度に写す数
+#define KILO_TOKEN_BATCH 8192
+#define KILO_TOKEN_COPY (64 * 1024)
+// grepの検索スレッド数の上限と、結果の行に載せる本文の最大長
+#define KILO_GREP_THREADS 64
+#define KILO_GREP_LINE_MAX 200
+// 行の並べ替え・絞り込みのスレッド数の上限と、これより少ない行は1スレッドでやる
+#define KILO_SORT_THREADS 64
+#define KILO_SORT_MIN_PAR (1 << 14)
+// 変更行の印を出す左端の桁数
+#define KILO_GUTTER 1
+// これより大きいファイルは行の索引をキャッシュに書き、次に開くときに使う
+#define KILO_CACHE_MIN (1 << 20)
+// キャッシュが同じファイルのものか確かめるために読む標本の数と大きさ
+#define KILO_CACHE_SAMPLES 16
+#define KILO_CACHE_SAMPLE_SIZE 4096
+// 入力待ちの仕事を1回に続けて行う時間(マイクロ秒)の既定値
+#define KILO_IDLE_SLICE_US 4000
+// 入力待ちの仕事を画面を更新せずに続ける時間の上限(マイクロ秒)
+#define KILO_IDLE_FRAME_US 50000
+// 先頭のこの大きさにNULがあればバイナリとして16進表示で開く
+#define KILO_HEX_SNIFF 8192
+// 16進表示の1行のバイト数と、検索で一度に走査する大きさ
+#define KILO_HEX_COLS 16
+#define KILO_HEX_SCAN (64 << 20)
+// パイプから一度に読む大きさ。Linuxのパイプのバッファと同じにしておく
+#define KILO_STREAM_CHUNK (64 * 1024)
 
 // data
 struct editorSyntax {
@@ -39,11 +91,165 @@ typedef struct erow {
   int idx;
   int size;
   int rsize;
+  // renderがASCIIだけか(バイト位置がそのまま表示桁になる)と、renderの表示幅
+  int ascii;
+  int rwidth;
+  // 非ASCIIの行を折り返したときの表示行数と、それを数えたときの画面幅
+  int wlines;
+  int wcols;
   char *chars;
   char *render;
   unsigned char *hl;
   int hl_open_comment;
+  // charsのハッシュ。editorUpdateRowで更新される
+  uint64_t hash;
+  // 圧縮されている場合はそのブロックとブロック内での順番
+  struct coldBlock *cold;
+  int cold_i;
+  // この行が確保しているバイト数と最後に触ったときのE.tick
+  int mem;
+  unsigned int touched;
+  // 文字列・コメント外の括弧のrender上の位置と、開きを+1・閉じを-1とした
+  // 合計・最小の前置和・最大の後置和。圧縮中もこの3つは残る
+  int *br;
+  int nbr;
+  int br_sum;
+  int br_minpre;
+  int br_maxsuf;
+  // この行の単語がトークン索引に数えられているか
+  int tok_counted;
+  // ハイライトを後回しにしたか
+  int hl_stale;
+  // 折りたたみの見出し行なら隠している後続の行数。隠れている行はhiddenが1
+  int folded;
+  int hidden;
+  // 保存版で同じ内容の対応する行(なければ-1)と、左端に出す変更の印
+  int bidx;
+  int gut;
+  // ファイル上の位置。保存済みのバッファではcharsを捨てて、ここから読み戻せる
+  off_t foff;
+  // 読み戻せずに空白で埋めたか。E.lostに数えるのは一度だけにする
+  int lost;
 } erow;
+// トークン索引(開番地法のハッシュ表)の要素。countが0のものは死んでいる
+struct tokenEntry {
+  char *key;
+  int len;
+  int count;
+  uint64_t hash;
+};
+// 単語の併合の途中経過。tailは並べ替えた新しい単語、outは併合先で、
+// tok_sortedのi個目とtailのj個目までをk個目まで書いたところ
+struct tokenMerge {
+  char **tail;
+  int ntail;
+  char **out;
+  int i, j, k;
+};
+// 表示行の索引。行ごとの表示行数cntを塊に分け、塊ごとの行数bnと表示行数bsの
+// 累積和をそれぞれFenwick木tn,tsで持つ。行の挿入・削除は塊の中で済む
+struct wrapIndex {
+  int *cnt;
+  int n, cap;
+  int cols;
+  int *bn, *bs;
+  int *tn, *ts;
+  int nb, bcap;
+};
+// 括弧の索引のセグメント木の節
+struct bracketNode {
+  int sum;
+  int minpre;
+  int maxsuf;
+};
+// 括弧の索引。行を塊に分け、塊ごとの要約bvをセグメント木segの葉に載せる。
+// 塊の行数bnの累積和はFenwick木tnで持つ。dirtyは要約を作り直す塊の印
+struct bracketTree {
+  struct bracketNode *seg;
+  int cap;
+  int n;
+  struct bracketNode *bv;
+  char *dirty;
+  int *bn, *tn;
+  int nb, bcap;
+  int ndirty;
+};
+// バッファごとの状態。表示中のバッファの状態はEに直接置き、
+// 切り替えるときにここへ退避・復元する
+struct editorBuffer {
+  int cx, cy;
+  int rx;
+  int rowoff;
+  int coloff;
+  int numrows;
+  int dirty;
+  char *filename;
+  erow *row;
+  struct editorSyntax *syntax;
+  int fd;
+  int lost;
+  int watch_fd;
+  int watch_wd;
+  int softwrap;
+  int voff;
+  struct wrapIndex *wrap;
+  int nfolds;
+  int sweep;
+  size_t sweep_dry;
+  unsigned int sweep_tick;
+  struct bracketTree *bt;
+  struct tokenEntry *tok;
+  int tok_cap;
+  int tok_n;
+  char **tok_keys;
+  char **tok_sorted;
+  int tok_nsorted;
+  struct tokenMerge tok_merge;
+  int tok_scan;
+  int grep_results;
+  uint64_t *base;
+  int base_n;
+  int gut_lo, gut_hi;
+  int gut_tail;
+  int stream_fd;
+  char *stream_part;
+  int stream_plen;
+  struct hexView *hex;
+  // 最後に表示していたときのE.tickと、キャッシュを追い出し済みか
+  unsigned int last_used;
+  int evicted;
+};
+// 16進表示で書き換えたまま保存していないバイト
+struct hexPatch {
+  off_t off;
+  unsigned char b;
+};
+// バイナリファイルの16進表示。ファイルはmmapしたまま読み、表示する範囲の
+// ページだけが読み込まれる。書き換えはpatchにためて保存時にpwriteする
+struct hexView {
+  int fd;
+  int writable;
+  unsigned char *map;
+  off_t size;
+  off_t top;
+  off_t cur;
+  int nib;
+  struct hexPatch *patch;
+  int npatch;
+  int patch_cap;
+};
+// 複数カーソルの1つ。cxはcharsの位置
+struct cursor {
+  int cy, cx;
+};
+// 圧縮された連続する行。chars/render/hlは解放されsize/rsizeなどだけが行に残る
+struct coldBlock {
+  unsigned int id;
+  char *data;
+  int clen;
+  int rawlen;
+  int nrows;
+};
 // キーの列挙型だね
 enum editorkey {
   BACK_SPACE = 127,
@@ -67,6 +273,8 @@ enum editorHilight {
   HL_NUMBER,
   HL_MATCH
 };
+// 左端に出す保存版からの変更の印
+enum gutterMark { GUT_NONE = 0, GUT_ADD, GUT_CHANGE, GUT_DEL };
 
 // ここにエディタの設定
 struct editorConfig {
@@ -85,6 +293,103 @@ struct editorConfig {
   char *filename;
   erow *row;
   struct editorSyntax *syntax;
+  // 外部変更の監視(inotify)
+  int watch_fd;
+  int watch_wd;
+  int prompting;
+  // 折り返し表示。voffは画面先頭の表示行番号
+  int softwrap;
+  int voff;
+  struct wrapIndex *wrap;
+  // 折りたたまれている範囲の数。隠れた行は表示行の木で0行として数える
+  int nfolds;
+  volatile sig_atomic_t resized;
+  // メモリ予算と冷えた行の圧縮
+  size_t mem_used;
+  size_t mem_budget;
+  unsigned int tick;
+  int sweep;
+  // 何も圧縮できなかった一巡の後のメモリ量とtick
+  size_t sweep_dry;
+  unsigned int sweep_tick;
+  int cold_blocks;
+  unsigned int cold_ids;
+  size_t cold_raw;
+  size_t cold_bytes;
+  long thaws;
+  double thaw_total_us;
+  double thaw_max_us;
+  // 括弧の索引と、カーソル下の括弧とその相手の位置(なければ-1)
+  struct bracketTree *bt;
+  int br_row[2];
+  int br_rx[2];
+  // バッファ内の単語の出現数。tok_keysは登録順、tok_sortedはそのうち
+  // 先頭tok_nsorted個を辞書順に並べたもので、補完の前方一致検索に使う。
+  // tok_scanはまだ数えていない行を入力待ちの間に探す位置(なければ-1)
+  struct tokenEntry *tok;
+  int tok_cap;
+  int tok_n;
+  char **tok_keys;
+  char **tok_sorted;
+  int tok_nsorted;
+  struct tokenMerge tok_merge;
+  int tok_scan;
+  // 追い出した行を読み戻すために開いておくファイル
+  int fd;
+  // ファイルが書き換えられて読み戻せなかった行の数。0でなければ保存しない
+  int lost;
+  // grepの結果を表示するバッファか
+  int grep_results;
+  // 最後に開いた・保存したときの各行のハッシュと、それ以降に変わった行の
+  // 範囲[gut_lo,gut_hi)。gut_loが-1なら比べ直すものはない。gut_tailは
+  // ファイル末尾の行が消されているときの印
+  uint64_t *base;
+  int base_n;
+  int gut_lo, gut_hi;
+  int gut_tail;
+  // 読み込み中のパイプ(なければ-1)と、まだ改行が来ていない最後の行
+  int stream_fd;
+  char *stream_part;
+  int stream_plen;
+  // バイナリファイルなら16進表示の状態(テキストならNULL)
+  struct hexView *hex;
+  // 実行中のgrep
+  struct grepJob *grep;
+  // サーバーとして動いているか、クライアントが接続中か。接続中は
+  // 標準入出力がクライアントのソケットになる
+  int server;
+  int attached;
+  int client_rows;
+  int client_cols;
+  unsigned char inbuf[4096];
+  int in_len;
+  int in_pos;
+  // 前回書き出した画面の各行。変わった行だけを書き出すのに使う
+  struct abuf *frame;
+  int frame_n;
+  // キーボードマクロ。editorReadKeyが返したキーを記録し、再生中はそこから返す
+  int *macro;
+  int macro_n;
+  int macro_cap;
+  int macro_pos;
+  int recording;
+  int replaying;
+  // 0でなければハイライトを後回しにする(マクロの再生中と複数カーソルの編集中)
+  int hl_defer;
+  // ハイライトを後回しにした行の最小の番号(なければ-1)
+  int hl_lo;
+  // 入力待ちの仕事を続けて行う時間の上限。キーが来てから画面を描くまでの
+  // 遅れはこれで抑えられる
+  long long idle_slice_us;
+  // 複数カーソル。(cy,cx)の順に並べ、mc[mc_main]がE.cx/E.cyと同じ位置
+  struct cursor *mc;
+  int mc_n;
+  int mc_cap;
+  int mc_main;
+  // 開いているバッファ。bufs[curbuf]は表示中なので中身はEにある
+  struct editorBuffer *bufs;
+  int nbufs;
+  int curbuf;
 };
 // editorの設定をグローバル変数にしてる。
 struct editorConfig E;
@@ -107,7 +412,22 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void ediotorScroll();
+void editorFrameInvalidate();
+int editorCheckFileChange();
+void editorRowTouch(erow *row);
+void editorUpdateBrackets(erow *row);
+void editorTokenScanRow(erow *row, int delta);
+uint64_t editorHashBytes(const char *s, int len);
+erow *editorRowAt(int at);
+char *editorRowPeek(erow *row);
+void editorEvictBackground();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorProcessKeyPress();
+int editorGrepPoll();
+void editorGutterDirty(int lo, int hi);
+void editorGutterShift(int at, int delta);
+int editorIdleRun();
 
 /*** terminal ***/
 // エラーハンドラ
@@ -141,23 +461,109 @@ void enableRawMode() {
     die("tcsetattr");
 }
 
-int editorReadKey() {
-  int nread;
+// クライアントから次の1バイトを受け取る。wait_msだけ待って来なければ0を返す
+int editorClientByte(unsigned char *c, int wait_ms) {
+  if (E.in_pos == E.in_len) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    int r = poll(&pfd, 1, wait_ms);
+    if (r == -1 && errno != EINTR)
+      return -1;
+    if (r <= 0)
+      return 0;
+    ssize_t n = read(STDIN_FILENO, E.inbuf, sizeof(E.inbuf));
+    if (n <= 0)
+      return -1;
+    E.in_len = n;
+    E.in_pos = 0;
+  }
+  *c = E.inbuf[E.in_pos++];
+  return 1;
+}
+// パイプを読み込み中なら、キー入力かパイプのデータが来るまで最大0.1秒待つ。
+// キー入力があれば1を返す。VTIMEで待つとその間パイプを読めないため
+int editorStreamWait() {
+  if (E.server || E.stream_fd == -1)
+    return 1;
+  struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0},
+                          {E.stream_fd, POLLIN, 0}};
+  if (poll(pfd, 2, 100) <= 0)
+    return 0;
+  return (pfd[0].revents & POLLIN) != 0;
+}
+// キー入力を1バイト読む。端末ではVTIMEの0.1秒で、サーバーではpollで待つ。
+// クライアントは0xffに続けて制御メッセージを送ってくる(0xff 0xffは0xff自身、
+// 0xff 'W' 行数2バイト 桁数2バイトは画面サイズの変更)
+int editorReadByte(char *c) {
+  if (!E.server)
+    return read(STDIN_FILENO, c, 1);
+  // 切断されたらESCを返し続けて、プロンプトなどを抜けさせる
+  if (!E.attached) {
+    *c = '\x1b';
+    return 1;
+  }
+  for (;;) {
+    unsigned char b;
+    int r = editorClientByte(&b, 100);
+    if (r == 1 && b == 0xff) {
+      unsigned char op;
+      r = editorClientByte(&op, -1);
+      if (r == 1 && op == 'W') {
+        unsigned char sz[4];
+        for (int j = 0; j < 4 && r == 1; j++)
+          r = editorClientByte(&sz[j], -1);
+        if (r == 1) {
+          E.client_rows = sz[0] << 8 | sz[1];
+          E.client_cols = sz[2] << 8 | sz[3];
+          E.resized = 1;
+          // エスケープシーケンスの途中に来ることもあるので続けて次のバイトを読む
+          continue;
+        }
+      }
+    }
+    if (r == -1) {
+      E.attached = 0;
+      *c = '\x1b';
+      return 1;
+    }
+    if (r == 1)
+      *c = b;
+    return r;
+  }
+}
+
+// 読まれていない入力があるか
+int editorInputPending() {
+  if (E.server && (!E.attached || E.in_pos < E.in_len))
+    return 1;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+int editorDecodeKey() {
+  int nread = 0;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
+  // 入力が来るまでの間に後回しにした仕事を進める
+  if (editorIdleRun())
+    editorRefreshScreen();
+  while (!editorStreamWait() || (nread = editorReadByte(&c)) != 1) {
+    if (nread == -1 && errno != EAGAIN && errno != EINTR)
       die("read");
+    nread = 0;
+    // キー入力待ちの間に外部の変更と画面サイズの変更を確認する
+    int redraw = editorIdleRun();
+    if (editorCheckFileChange() || editorGrepPoll() || E.resized || redraw)
+      editorRefreshScreen();
   }
   if (c == '\x1b') {
     char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (editorReadByte(&seq[0]) != 1)
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    if (editorReadByte(&seq[1]) != 1)
       return '\x1b';
     if (seq[0] == '[') {
       //
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDOUT_FILENO, &seq[2], 1) != 1)
+        if (editorReadByte(&seq[2]) != 1)
           return '\x1b';
         if (seq[2] == '~') {
           switch (seq[1]) {
@@ -203,8 +609,28 @@ int editorReadKey() {
     }
     return '\x1b';
   } else {
-    return c;
+    // UTF-8の各バイトは128-255で返す
+    return (unsigned char)c;
+  }
+}
+
+// キーを1つ読む。マクロの記録中は記録し、再生中は記録から返す
+int editorReadKey() {
+  if (E.replaying) {
+    // 記録が尽きたらESCでプロンプトなどを抜けさせる
+    if (E.macro_pos >= E.macro_n)
+      return '\x1b';
+    return E.macro[E.macro_pos++];
   }
+  int c = editorDecodeKey();
+  if (E.recording) {
+    if (E.macro_n == E.macro_cap) {
+      E.macro_cap = E.macro_cap ? E.macro_cap * 2 : 64;
+      E.macro = realloc(E.macro, sizeof(int) * E.macro_cap);
+    }
+    E.macro[E.macro_n++] = c;
+  }
+  return c;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -233,6 +659,12 @@ int getCursorPosition(int *rows, int *cols) {
 
 int getWindowsSize(int *rows, int *cols) {
   struct winsize ws;
+  // サーバーではクライアントが知らせてきた大きさを使う
+  if (E.server) {
+    *rows = E.client_rows;
+    *cols = E.client_cols;
+    return 0;
+  }
   // ioctr terminal制御　windowszieの取得
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     // 標準出力に12バイト書き込んでいる。
@@ -250,11 +682,36 @@ int getWindowsSize(int *rows, int *cols) {
 int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
+// 補完で単語とみなす文字
+int is_ident_char(int c) { return isalnum((unsigned char)c) || c == '_'; }
 void editorUpdateSyntax(erow *row) {
+  if (row->cold || row->render == NULL) {
+    // 圧縮・追い出しされている行は作り直すときにハイライトされる
+    editorRowTouch(row);
+    return;
+  }
+  // 後回しにする間は、あとでまとめてハイライトする
+  if (E.hl_defer) {
+    row->hl = realloc(row->hl, row->rsize);
+    memset(row->hl, HL_NORMAL, row->rsize);
+    // 括弧の位置は古いrenderのものなので、付け直すまで使わせない
+    row->nbr = 0;
+    row->hl_stale = 1;
+    if (E.hl_lo == -1 || row->idx < E.hl_lo)
+      E.hl_lo = row->idx;
+    return;
+  }
+  row->hl_stale = 0;
+  if (!row->tok_counted) {
+    editorTokenScanRow(row, 1);
+    row->tok_counted = 1;
+  }
   row->hl = realloc(row->hl, row->rsize);
   memset(row->hl, HL_NORMAL, row->rsize);
-  if (E.syntax == NULL)
+  if (E.syntax == NULL) {
+    editorUpdateBrackets(row);
     return;
+  }
   char **keywords = E.syntax->keywords;
   char *scs = E.syntax->singleline_comment_start;
   char *mcs = E.syntax->multiline_comment_start;
@@ -348,11 +805,60 @@ void editorUpdateSyntax(erow *row) {
     prev_sep = is_separator(c);
     i++;
   }
+  editorUpdateBrackets(row);
   int changed = (row->hl_open_comment != in_comment);
   row->hl_open_comment = in_comment;
   if (changed && row->idx + 1 < E.numrows)
     editorUpdateSyntax(&E.row[row->idx + 1]);
 }
+// 単調増加する時計の現在値(マイクロ秒)
+long long kiloNowUs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+// 後回しにしたハイライトを上の行から順に行lastまで付け直す。複数行コメントの
+// 状態はeditorUpdateSyntaxが次の行へ伝えていく。deadline(kiloNowUs)を過ぎたら
+// 途中でやめ、続きはE.hl_loに残す。deadlineが0なら最後までやる
+void editorSyntaxFlushRange(int last, long long deadline) {
+  if (E.hl_lo == -1)
+    return;
+  int defer = E.hl_defer;
+  E.hl_defer = 0;
+  int j;
+  for (j = E.hl_lo; j < E.numrows && j <= last; j++) {
+    if (deadline && (j & 63) == 0 && kiloNowUs() >= deadline)
+      break;
+    erow *row = &E.row[j];
+    if (!row->hl_stale)
+      continue;
+    // 圧縮・追い出しされた行は作り直すときにハイライトされる
+    if (row->cold || row->render == NULL)
+      row->hl_stale = 0;
+    else
+      editorUpdateSyntax(row);
+  }
+  E.hl_lo = j < E.numrows ? j : -1;
+  E.hl_defer = defer;
+}
+void editorSyntaxFlush() { editorSyntaxFlushRange(E.numrows, 0); }
+// 画面に出る行first..lastのハイライトを済ませる。上から順に付け直すのが
+// E.idle_slice_usに収まらなければ画面の行だけ先に付け、その上の行は入力待ちの
+// 間に済ませる。複数行コメントの状態が変わればそのとき下の行へ伝わる
+void editorSyntaxFlushView(int first, int last) {
+  editorSyntaxFlushRange(last, kiloNowUs() + E.idle_slice_us);
+  if (E.hl_lo == -1 || E.hl_lo > last)
+    return;
+  int defer = E.hl_defer;
+  E.hl_defer = 0;
+  for (int j = first > E.hl_lo ? first : E.hl_lo; j <= last && j < E.numrows;
+       j++) {
+    erow *row = &E.row[j];
+    if (row->hl_stale && !row->cold && row->render != NULL)
+      editorUpdateSyntax(row);
+  }
+  E.hl_defer = defer;
+}
 int editorSyntaxToColor(int hl) {
   switch (hl) {
   case HL_COMMENT:
@@ -395,196 +901,2658 @@ void editorSelectSyntaxHighlight() {
     }
   }
 }
-/*** row operations ***/
-// カーソルなどの詳細は忘れるが、row操作の詳細は記述される
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
-    } else {
-      rx++;
+/*** utf-8 ***/
+// sからUTF-8の1文字を読み、バイト数を返す。不正なバイト列は1バイトを
+// U+FFFDとして読む
+int kiloDecodeUtf8(const char *s, int n, unsigned int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int len;
+  unsigned int c;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if ((u[0] & 0xe0) == 0xc0) {
+    len = 2;
+    c = u[0] & 0x1f;
+  } else if ((u[0] & 0xf0) == 0xe0) {
+    len = 3;
+    c = u[0] & 0x0f;
+  } else if ((u[0] & 0xf8) == 0xf0) {
+    len = 4;
+    c = u[0] & 0x07;
+  } else {
+    *cp = 0xfffd;
+    return 1;
+  }
+  if (len > n) {
+    *cp = 0xfffd;
+    return 1;
+  }
+  for (int j = 1; j < len; j++) {
+    if ((u[j] & 0xc0) != 0x80) {
+      *cp = 0xfffd;
+      return 1;
     }
+    c = (c << 6) | (u[j] & 0x3f);
   }
-  return rx;
+  // 冗長な表現とサロゲートは不正とする
+  if ((len == 2 && c < 0x80) || (len == 3 && c < 0x800) ||
+      (len == 4 && (c < 0x10000 || c > 0x10ffff)) ||
+      (c >= 0xd800 && c <= 0xdfff)) {
+    *cp = 0xfffd;
+    return 1;
+  }
+  *cp = c;
+  return len;
 }
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t') {
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    }
-    cur_rx++;
-    if (cur_rx > rx)
-      return cx;
+// 端末上の表示幅。結合文字は0、東アジアの全角文字は2
+int kiloCharWidth(unsigned int c) {
+  if (c < 0x300)
+    return 1;
+  if ((c >= 0x300 && c <= 0x36f) || (c >= 0x200b && c <= 0x200f) ||
+      (c >= 0x20d0 && c <= 0x20ff) || (c >= 0xfe00 && c <= 0xfe0f) ||
+      (c >= 0x3099 && c <= 0x309a))
+    return 0;
+  if ((c >= 0x1100 && c <= 0x115f) || (c >= 0x2e80 && c <= 0x303e) ||
+      (c >= 0x3041 && c <= 0x33ff) || (c >= 0x3400 && c <= 0x4dbf) ||
+      (c >= 0x4e00 && c <= 0x9fff) || (c >= 0xa000 && c <= 0xa4cf) ||
+      (c >= 0xac00 && c <= 0xd7a3) || (c >= 0xf900 && c <= 0xfaff) ||
+      (c >= 0xfe30 && c <= 0xfe4f) || (c >= 0xff00 && c <= 0xff60) ||
+      (c >= 0xffe0 && c <= 0xffe6) || (c >= 0x1f300 && c <= 0x1f64f) ||
+      (c >= 0x1f900 && c <= 0x1f9ff) || (c >= 0x20000 && c <= 0x3fffd))
+    return 2;
+  return 1;
+}
+// sがASCIIだけなら1を返し、*tabsにタブの数を入れる。SSE2があれば32バイトずつ調べる
+int kiloScanAscii(const char *s, int n, int *tabs) {
+  int t = 0;
+  int high = 0;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 32 <= n; i += 32) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+    high |= _mm_movemask_epi8(_mm_or_si128(a, b));
+    t += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, tab)));
+    t += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(b, tab)));
   }
-  return cx;
+#endif
+  for (; i < n; i++) {
+    high |= s[i] & 0x80;
+    t += s[i] == '\t';
+  }
+  *tabs = t;
+  return high == 0;
 }
-
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
-  free(row->render);
-  row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+// タブを展開してoutに書き、書いたバイト数を返す。outにはsize+tabs*(KILO_TAB_STOP-1)+1
+// バイト要る。colsには表示桁数を返す
+int kiloExpandTabs(const char *s, int size, int ascii, char *out, int *cols) {
   int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+  int j;
+  if (ascii) {
+    for (j = 0; j < size; j++) {
+      if (s[j] == '\t') {
+        out[idx++] = ' ';
+        while (idx % KILO_TAB_STOP != 0)
+          out[idx++] = ' ';
+      } else {
+        out[idx++] = s[j];
+      }
+    }
+    *cols = idx;
+  } else {
+    // 非ASCIIの行ではタブの位置を表示桁で数える
+    int col = 0;
+    for (j = 0; j < size;) {
+      if (s[j] == '\t') {
+        do {
+          out[idx++] = ' ';
+          col++;
+        } while (col % KILO_TAB_STOP != 0);
+        j++;
+        continue;
+      }
+      unsigned int cp = (unsigned char)s[j];
+      int n = 1;
+      if (cp >= 0x80)
+        n = kiloDecodeUtf8(&s[j], size - j, &cp);
+      memcpy(&out[idx], &s[j], n);
+      idx += n;
+      j += n;
+      col += kiloCharWidth(cp);
     }
+    *cols = col;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
-  editorUpdateSyntax(row);
+  out[idx] = '\0';
+  return idx;
+}
+// renderのバイト位置offの表示桁
+int editorRenderCol(erow *row, int off) {
+  if (row->ascii)
+    return off;
+  int col = 0;
+  for (int j = 0; j < off && j < row->rsize;) {
+    unsigned int cp;
+    j += kiloDecodeUtf8(&row->render[j], row->rsize - j, &cp);
+    col += kiloCharWidth(cp);
+  }
+  return col;
+}
+// 表示桁colにある文字のrenderでのバイト位置
+int editorRenderOffset(erow *row, int col) {
+  if (row->ascii)
+    return col < row->rsize ? col : row->rsize;
+  int c = 0;
+  int j = 0;
+  while (j < row->rsize) {
+    unsigned int cp;
+    int n = kiloDecodeUtf8(&row->render[j], row->rsize - j, &cp);
+    int w = kiloCharWidth(cp);
+    if (c + w > col)
+      break;
+    c += w;
+    j += n;
+  }
+  return j;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at > E.numrows || at < 0)
-    return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++)
-    E.row[j].idx++;
-  E.row[at].idx = at;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  // 最下の列の長さを取得している。// そもそもここには存在しないはずでは？
-  E.row[at].size = len;
-  // それにプラス1をしてメモリ確保？？--2
-  E.row[at].chars = malloc(len + 1);
-  // そこにsをコピー
-  memcpy(E.row[at].chars, s, len);
-  // これが--2の理由か。。。
-  E.row[at].chars[len] = '\0';
+/*** fenwick ***/
+// 表示行の索引と括弧の索引で、塊ごとの累積和に使う
+// v[0,n)からFenwick木t[1..n]を作る
+void kiloFenwickBuild(int *t, const int *v, int n) {
+  for (int i = 1; i <= n; i++)
+    t[i] = v[i - 1];
+  for (int i = 1; i <= n; i++) {
+    int j = i + (i & -i);
+    if (j <= n)
+      t[j] += t[i];
+  }
+}
+void kiloFenwickAdd(int *t, int n, int at, int delta) {
+  for (int i = at + 1; i <= n; i += i & -i)
+    t[i] += delta;
+}
+int kiloFenwickPrefix(const int *t, int at) {
+  int sum = 0;
+  for (int i = at; i > 0; i -= i & -i)
+    sum += t[i];
+  return sum;
+}
+// 累積和がv以下に収まる最も長い先頭の要素数を返す。*restにはvの残りが入る
+int kiloFenwickFind(const int *t, int n, int v, int *rest) {
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= n)
+    step *= 2;
+  for (; step; step >>= 1) {
+    if (pos + step <= n && t[pos + step] <= v) {
+      pos += step;
+      v -= t[pos];
+    }
+  }
+  *rest = v;
+  return pos;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
-  E.numrows++;
-  E.dirty++;
+/*** brackets ***/
+// 括弧の対応を調べるための索引。行ごとの括弧の要約をセグメント木に載せ、
+// 行をまたぐ対応の探索は木を下りてO(log n)で行う。
+// 葉は数百行の塊で、行の中身が変わったときや行の挿入・削除ではその塊に印を
+// 付け、次に探すときに印の付いた塊と祖先だけを直す。
+int editorIsBracket(int c) { return c != '\0' && strchr("()[]{}", c) != NULL; }
+int editorBracketDir(int c) { return strchr("([{", c) ? 1 : -1; }
+int editorBracketPair(int c) {
+  switch (c) {
+  case '(':
+    return ')';
+  case ')':
+    return '(';
+  case '[':
+    return ']';
+  case ']':
+    return '[';
+  case '{':
+    return '}';
+  default:
+    return '{';
+  }
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+struct bracketNode bracketMerge(struct bracketNode a, struct bracketNode b) {
+  struct bracketNode r;
+  r.sum = a.sum + b.sum;
+  r.minpre = a.minpre < a.sum + b.minpre ? a.minpre : a.sum + b.minpre;
+  r.maxsuf = b.maxsuf > b.sum + a.maxsuf ? b.maxsuf : b.sum + a.maxsuf;
+  return r;
 }
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows)
+void editorBracketInvalidate() {
+  struct bracketTree *t = E.bt;
+  if (t == NULL)
     return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++)
-    E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+  free(t->seg);
+  free(t->bv);
+  free(t->dirty);
+  free(t->bn);
+  free(t->tn);
+  free(t);
+  E.bt = NULL;
 }
-// E.rowに挿入
-
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) {
-    at = row->size;
+// 行[start,start+n)の括弧の要約
+struct bracketNode editorBracketRows(int start, int n) {
+  struct bracketNode r = {0, 0, 0};
+  for (int j = start; j < start + n; j++) {
+    struct bracketNode nd = {E.row[j].br_sum, E.row[j].br_minpre,
+                             E.row[j].br_maxsuf};
+    r = bracketMerge(r, nd);
   }
-  // 末尾とnull byteの領域を新たに確保する。
-  row->chars = realloc(row->chars, row->size + 2);
-  // null byte用の領域も合わせてコピー
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  // nullの領域はサイズに加味しない
-  row->size++;
-  row->chars[at] = c;
-  // rsizeとrender を更新する
-  editorUpdateRow(row);
-  E.dirty++;
+  return r;
 }
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+// 塊の数が変わったときに塊の行数の木とセグメント木を作り直す
+void editorBracketBlocksBuild(struct bracketTree *t) {
+  t->tn = realloc(t->tn, sizeof(int) * (t->bcap + 1));
+  kiloFenwickBuild(t->tn, t->bn, t->nb);
+  t->cap = 1;
+  while (t->cap < t->nb)
+    t->cap *= 2;
+  free(t->seg);
+  t->seg = calloc(2 * t->cap, sizeof(struct bracketNode));
+  memcpy(&t->seg[t->cap], t->bv, sizeof(struct bracketNode) * t->nb);
+  for (int j = t->cap - 1; j >= 1; j--)
+    t->seg[j] = bracketMerge(t->seg[2 * j], t->seg[2 * j + 1]);
+}
+void editorBracketBuild() {
+  struct bracketTree *t = E.bt;
+  if (t && t->n == E.numrows) {
+    // 印の付いた塊の要約と祖先を直す
+    if (t->ndirty == 0)
+      return;
+    int start = 0;
+    for (int b = 0; b < t->nb; start += t->bn[b++]) {
+      if (!t->dirty[b])
+        continue;
+      t->dirty[b] = 0;
+      t->bv[b] = editorBracketRows(start, t->bn[b]);
+      t->seg[t->cap + b] = t->bv[b];
+      for (int j = (t->cap + b) / 2; j >= 1; j /= 2)
+        t->seg[j] = bracketMerge(t->seg[2 * j], t->seg[2 * j + 1]);
+    }
+    t->ndirty = 0;
+    return;
   }
-  E.cy++;
-  E.cx = 0;
+  editorBracketInvalidate();
+  t = calloc(1, sizeof(struct bracketTree));
+  t->n = E.numrows;
+  t->bcap = (E.numrows + KILO_BRACKET_BLOCK - 1) / KILO_BRACKET_BLOCK + 1;
+  t->bv = malloc(sizeof(struct bracketNode) * t->bcap);
+  t->dirty = calloc(t->bcap, 1);
+  t->bn = malloc(sizeof(int) * t->bcap);
+  for (int start = 0; start < t->n; start += KILO_BRACKET_BLOCK) {
+    int n = t->n - start < KILO_BRACKET_BLOCK ? t->n - start
+                                               : KILO_BRACKET_BLOCK;
+    t->bn[t->nb] = n;
+    t->bv[t->nb++] = editorBracketRows(start, n);
+  }
+  editorBracketBlocksBuild(t);
+  E.bt = t;
 }
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// 行atを含む塊を返す。*startにはその塊の先頭の行が入る。atが末尾なら最後の塊
+int editorBracketBlock(struct bracketTree *t, int at, int *start) {
+  int off;
+  int b = kiloFenwickFind(t->tn, t->nb, at, &off);
+  if (b == t->nb) {
+    b--;
+    off = t->bn[b];
+  }
+  *start = at - off;
+  return b;
+}
+void editorBracketMark(struct bracketTree *t, int b) {
+  if (!t->dirty[b]) {
+    t->dirty[b] = 1;
+    t->ndirty++;
+  }
 }
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size)
+// 行atの括弧が変わった
+void editorBracketUpdate(int at) {
+  if (E.bt == NULL || at >= E.bt->n)
     return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+  int start;
+  editorBracketMark(E.bt, editorBracketBlock(E.bt, at, &start));
 }
-// editor
-// operations(row操作の詳細を忘れるが、カーソルに関しては詳細に記述される)
-
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+// 行atに行が挿入された
+void editorBracketInsert(int at) {
+  struct bracketTree *t = E.bt;
+  if (t == NULL)
+    return;
+  t->n++;
+  if (t->nb == 0) {
+    t->bn[0] = 1;
+    t->bv[0] = (struct bracketNode){0, 0, 0};
+    t->dirty[0] = 1;
+    t->nb = 1;
+    t->ndirty = 1;
+    editorBracketBlocksBuild(t);
+    return;
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  int start;
+  int b = editorBracketBlock(t, at, &start);
+  t->bn[b]++;
+  editorBracketMark(t, b);
+  if (t->bn[b] <= 2 * KILO_BRACKET_BLOCK) {
+    kiloFenwickAdd(t->tn, t->nb, b, 1);
+    return;
+  }
+  // 大きくなりすぎた塊を半分に分ける。どちらの要約も次に探すときに作る
+  if (t->nb == t->bcap) {
+    t->bcap *= 2;
+    t->bv = realloc(t->bv, sizeof(struct bracketNode) * t->bcap);
+    t->dirty = realloc(t->dirty, t->bcap);
+    t->bn = realloc(t->bn, sizeof(int) * t->bcap);
+  }
+  int rest = t->nb - b - 1;
+  memmove(&t->bv[b + 2], &t->bv[b + 1], sizeof(struct bracketNode) * rest);
+  memmove(&t->dirty[b + 2], &t->dirty[b + 1], rest);
+  memmove(&t->bn[b + 2], &t->bn[b + 1], sizeof(int) * rest);
+  t->nb++;
+  t->bn[b + 1] = t->bn[b] - t->bn[b] / 2;
+  t->bn[b] /= 2;
+  t->dirty[b + 1] = 1;
+  t->ndirty++;
+  editorBracketBlocksBuild(t);
 }
-void editorDelChar() {
-  if (E.cy == E.numrows)
+// 行atが削除された
+void editorBracketDelete(int at) {
+  struct bracketTree *t = E.bt;
+  if (t == NULL || at >= t->n)
     return;
-  if (E.cx == 0 && E.cy == 0)
+  int start;
+  int b = editorBracketBlock(t, at, &start);
+  t->n--;
+  t->bn[b]--;
+  if (t->bn[b] > 0) {
+    editorBracketMark(t, b);
+    kiloFenwickAdd(t->tn, t->nb, b, -1);
     return;
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
   }
+  // 空になった塊は取り除く
+  if (t->dirty[b])
+    t->ndirty--;
+  int rest = t->nb - b - 1;
+  memmove(&t->bv[b], &t->bv[b + 1], sizeof(struct bracketNode) * rest);
+  memmove(&t->dirty[b], &t->dirty[b + 1], rest);
+  memmove(&t->bn[b], &t->bn[b + 1], sizeof(int) * rest);
+  t->nb--;
+  editorBracketBlocksBuild(t);
 }
-// file io
-char *ediotrRowsToString(int *buflen) {
-  int totlen = 0;
+// 塊lから下に進み、未対応の開き括弧の数*dが0になる最初の塊を返す
+int bracketFindForward(int node, int nl, int nr, int l, int *d) {
+  if (nr <= l)
+    return -1;
+  if (nl >= l && *d + E.bt->seg[node].minpre > 0) {
+    *d += E.bt->seg[node].sum;
+    return -1;
+  }
+  if (nr - nl == 1)
+    return nl;
+  int mid = (nl + nr) / 2;
+  int at = bracketFindForward(2 * node, nl, mid, l, d);
+  if (at >= 0)
+    return at;
+  return bracketFindForward(2 * node + 1, mid, nr, l, d);
+}
+// 塊rより前を後ろから順に見て、未対応の閉じ括弧の数*dが0になる最初の塊を返す
+int bracketFindBackward(int node, int nl, int nr, int r, int *d) {
+  if (nl >= r)
+    return -1;
+  if (nr <= r && *d - E.bt->seg[node].maxsuf > 0) {
+    *d -= E.bt->seg[node].sum;
+    return -1;
+  }
+  if (nr - nl == 1)
+    return nl;
+  int mid = (nl + nr) / 2;
+  int at = bracketFindBackward(2 * node + 1, mid, nr, r, d);
+  if (at >= 0)
+    return at;
+  return bracketFindBackward(2 * node, nl, mid, r, d);
+}
+// 行lから下に進み、*dが0になる最初の行を返す。lのある塊の中は行ごとに見て、
+// その先は木で相手のある塊まで飛ぶ
+int editorBracketForward(int l, int *d) {
+  struct bracketTree *t = E.bt;
+  if (l >= t->n)
+    return -1;
+  int start;
+  int b = editorBracketBlock(t, l, &start);
   int j;
-  for (j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1;
+  for (j = l; j < start + t->bn[b]; j++) {
+    if (*d + E.row[j].br_minpre <= 0)
+      return j;
+    *d += E.row[j].br_sum;
   }
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+  b = bracketFindForward(1, 0, t->cap, b + 1, d);
+  if (b < 0 || b >= t->nb)
+    return -1;
+  // 木は見つけた塊の手前までの*dを返すので、塊の中を行ごとに見る
+  for (j = kiloFenwickPrefix(t->tn, b); j < t->n; j++) {
+    if (*d + E.row[j].br_minpre <= 0)
+      return j;
+    *d += E.row[j].br_sum;
   }
-  return buf;
+  return -1;
+}
+// 行rより上を下から順に見て、*dが0になる最初の行を返す
+int editorBracketBackward(int r, int *d) {
+  struct bracketTree *t = E.bt;
+  if (r <= 0)
+    return -1;
+  int start;
+  int b = editorBracketBlock(t, r - 1, &start);
+  int j;
+  for (j = r - 1; j >= start; j--) {
+    if (*d - E.row[j].br_maxsuf <= 0)
+      return j;
+    *d -= E.row[j].br_sum;
+  }
+  b = bracketFindBackward(1, 0, t->cap, b, d);
+  if (b < 0)
+    return -1;
+  for (j = kiloFenwickPrefix(t->tn, b + 1) - 1; j >= 0; j--) {
+    if (*d - E.row[j].br_maxsuf <= 0)
+      return j;
+    *d -= E.row[j].br_sum;
+  }
+  return -1;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-
+// editorUpdateSyntaxの最後に呼ばれ、ハイライト結果を使って括弧を拾い直す
+void editorUpdateBrackets(erow *row) {
+  int n = 0;
+  int j;
+  for (j = 0; j < row->rsize; j++) {
+    if (editorIsBracket(row->render[j]) && row->hl[j] != HL_STRING &&
+        row->hl[j] != HL_COMMENT && row->hl[j] != HL_ML_COMMENT)
+      n++;
+  }
+  row->br = realloc(row->br, sizeof(int) * (n ? n : 1));
+  row->nbr = 0;
+  int sum = 0, minpre = 0;
+  for (j = 0; j < row->rsize && row->nbr < n; j++) {
+    if (editorIsBracket(row->render[j]) && row->hl[j] != HL_STRING &&
+        row->hl[j] != HL_COMMENT && row->hl[j] != HL_ML_COMMENT) {
+      row->br[row->nbr++] = j;
+      sum += editorBracketDir(row->render[j]);
+      if (sum < minpre)
+        minpre = sum;
+    }
+  }
+  int suf = 0, maxsuf = 0;
+  for (j = row->nbr - 1; j >= 0; j--) {
+    suf += editorBracketDir(row->render[row->br[j]]);
+    if (suf > maxsuf)
+      maxsuf = suf;
+  }
+  row->br_sum = sum;
+  row->br_minpre = minpre;
+  row->br_maxsuf = maxsuf;
+  editorBracketUpdate(row->idx);
+}
+
+// 行filerowのrender上の位置rxにある括弧の相手を探す。見つかれば1を返す
+int editorFindBracketMatch(int filerow, int rx, int *mrow, int *mrx) {
+  // 括弧の索引はハイライトの結果から作るので、後回しの分を先に済ませる
+  editorSyntaxFlush();
+  erow *row = editorRowAt(filerow);
+  int k;
+  for (k = 0; k < row->nbr && row->br[k] != rx; k++)
+    ;
+  if (k == row->nbr)
+    return 0;
+  int c = row->render[rx];
+  int dir = editorBracketDir(c);
+  int d = 1;
+  int j;
+  int at = filerow;
+  // まず同じ行の中を探し、なければ木を使って相手のある行まで飛ぶ
+  for (j = k + dir; j >= 0 && j < row->nbr; j += dir) {
+    d += dir * editorBracketDir(row->render[row->br[j]]);
+    if (d == 0)
+      goto found;
+  }
+  editorBracketBuild();
+  if (dir > 0)
+    at = editorBracketForward(filerow + 1, &d);
+  else
+    at = editorBracketBackward(filerow, &d);
+  if (at < 0)
+    return 0;
+  row = editorRowAt(at);
+  for (j = dir > 0 ? 0 : row->nbr - 1; j >= 0 && j < row->nbr; j += dir) {
+    d += dir * editorBracketDir(row->render[row->br[j]]);
+    if (d == 0)
+      goto found;
+  }
+  return 0;
+found:
+  if (row->render[row->br[j]] != editorBracketPair(c))
+    return 0;
+  *mrow = at;
+  *mrx = row->br[j];
+  return 1;
+}
+
+// カーソル下の括弧とその相手を覚えておき、描画時に強調する
+void editorUpdateBracketMatch() {
+  E.br_row[0] = E.br_row[1] = -1;
+  if (E.cy >= E.numrows)
+    return;
+  erow *row = editorRowAt(E.cy);
+  int off = editorRenderOffset(row, E.rx);
+  if (off >= row->rsize || !editorIsBracket(row->render[off]))
+    return;
+  // 括弧の索引は全部の行のハイライトから作るので、後回しの分が1回の持ち時間で
+  // 済まなければ強調は入力待ちの間に追いついてからにする
+  if (E.hl_lo != -1) {
+    editorSyntaxFlushRange(E.numrows, kiloNowUs() + E.idle_slice_us);
+    if (E.hl_lo != -1)
+      return;
+  }
+  int mrow, mrx;
+  if (editorFindBracketMatch(E.cy, off, &mrow, &mrx)) {
+    E.br_row[0] = E.cy;
+    E.br_rx[0] = off;
+    E.br_row[1] = mrow;
+    E.br_rx[1] = mrx;
+  }
+}
+
+/*** tokens ***/
+// 補完のためのバッファ全体の単語索引。行がハイライトされるときに数え、
+// 行を書き換える前にその行の分を引く。単語はis_ident_charの並び。
+int editorTokenSlot(const char *s, int len, uint64_t h) {
+  int mask = E.tok_cap - 1;
+  int i = h & mask;
+  while (E.tok[i].key &&
+         (E.tok[i].hash != h || E.tok[i].len != len ||
+          memcmp(E.tok[i].key, s, len) != 0))
+    i = (i + 1) & mask;
+  return i;
+}
+void editorTokenGrow() {
+  struct tokenEntry *old = E.tok;
+  int oldcap = E.tok_cap;
+  E.tok_cap = oldcap ? oldcap * 2 : 1024;
+  E.tok = calloc(E.tok_cap, sizeof(struct tokenEntry));
+  for (int j = 0; j < oldcap; j++) {
+    if (old[j].key)
+      E.tok[editorTokenSlot(old[j].key, old[j].len, old[j].hash)] = old[j];
+  }
+  free(old);
+  E.tok_keys = realloc(E.tok_keys, sizeof(char *) * (E.tok_cap / 2));
+}
+void editorTokenAdd(const char *s, int len, int delta) {
+  if (E.tok_n + 1 > E.tok_cap / 2)
+    editorTokenGrow();
+  uint64_t h = editorHashBytes(s, len);
+  struct tokenEntry *e = &E.tok[editorTokenSlot(s, len, h)];
+  if (e->key == NULL) {
+    if (delta < 0)
+      return;
+    // 一度登録した単語は数が0になっても消さない(tok_sortedから指されるため)
+    e->key = strndup(s, len);
+    e->len = len;
+    e->hash = h;
+    E.tok_keys[E.tok_n++] = e->key;
+  }
+  e->count += delta;
+}
+int editorTokenCount(const char *s) {
+  if (E.tok == NULL)
+    return 0;
+  int len = strlen(s);
+  return E.tok[editorTokenSlot(s, len, editorHashBytes(s, len))].count;
+}
+// 英字か_で始まり、英数字と_だけでできた2文字以上の単語を数える
+void editorTokenScan(const char *s, int size, int delta) {
+  int j = 0;
+  while (j < size) {
+    while (j < size && !is_ident_char(s[j]))
+      j++;
+    int start = j;
+    while (j < size && is_ident_char(s[j]))
+      j++;
+    if (j - start >= 2 && !isdigit((unsigned char)s[start]))
+      editorTokenAdd(&s[start], j - start, delta);
+  }
+}
+void editorTokenScanRow(erow *row, int delta) {
+  editorTokenScan(row->chars, row->size, delta);
+}
+// 行を書き換える前に呼ぶ。圧縮・追い出しされた行は展開せずに読む
+void editorTokenRemoveRow(erow *row) {
+  if (row->tok_counted) {
+    editorTokenScan(editorRowPeek(row), row->size, -1);
+    row->tok_counted = 0;
+  }
+}
+
+int tokenCompare(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+// 新しく登録された単語をKILO_TOKEN_BATCH個ずつ並べ替え、並べ替え済みの列に
+// 併合する。deadline(kiloNowUs)を過ぎたら途中でやめて0を返し、続きは次に
+// 呼ばれたときにやる。deadlineが0ならその組を最後までやる
+int editorTokenMergeStep(long long deadline) {
+  struct tokenMerge *m = &E.tok_merge;
+  if (m->out == NULL) {
+    int nnew = E.tok_n - E.tok_nsorted;
+    if (nnew == 0)
+      return 1;
+    if (nnew > KILO_TOKEN_BATCH)
+      nnew = KILO_TOKEN_BATCH;
+    m->tail = malloc(sizeof(char *) * nnew);
+    memcpy(m->tail, &E.tok_keys[E.tok_nsorted], sizeof(char *) * nnew);
+    qsort(m->tail, nnew, sizeof(char *), tokenCompare);
+    m->ntail = nnew;
+    m->out = malloc(sizeof(char *) * (E.tok_nsorted + nnew));
+    m->i = m->j = m->k = 0;
+  }
+  while (m->i < E.tok_nsorted || m->j < m->ntail) {
+    if (deadline && kiloNowUs() >= deadline)
+      return 0;
+    // tail[j]より前に来る古い単語を二分探索で見つけてまとめて写す
+    int lo = m->i, hi = E.tok_nsorted;
+    while (m->j < m->ntail && lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (strcmp(E.tok_sorted[mid], m->tail[m->j]) <= 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    int n = (m->j < m->ntail ? lo : E.tok_nsorted) - m->i;
+    if (n > KILO_TOKEN_COPY)
+      n = KILO_TOKEN_COPY;
+    memcpy(&m->out[m->k], &E.tok_sorted[m->i], sizeof(char *) * n);
+    m->i += n;
+    m->k += n;
+    if (m->i == lo && m->j < m->ntail)
+      m->out[m->k++] = m->tail[m->j++];
+  }
+  free(m->tail);
+  free(E.tok_sorted);
+  E.tok_sorted = m->out;
+  E.tok_nsorted += m->ntail;
+  memset(m, 0, sizeof(*m));
+  return 1;
+}
+void editorTokenMerge() {
+  while (E.tok_nsorted < E.tok_n)
+    editorTokenMergeStep(0);
+}
+// 出現数の降順を保ったまま候補を加える
+void tokenCandidate(char *key, int count, char **out, int *counts, int *n,
+                    int max) {
+  int k = *n < max ? (*n)++ : max;
+  while (k > 0 && counts[k - 1] < count) {
+    if (k < max) {
+      out[k] = out[k - 1];
+      counts[k] = counts[k - 1];
+    }
+    k--;
+  }
+  if (k < max) {
+    out[k] = key;
+    counts[k] = count;
+  }
+}
+// prefixで始まりそれより長い単語を出現数の多い順に最大max個返す。
+// 並べ替え前の新しい単語が少ないうちは併合せずに順に調べる
+int editorTokenComplete(const char *prefix, int plen, char **out, int max) {
+  if (E.tok_n - E.tok_nsorted > 4096)
+    editorTokenMerge();
+  int lo = 0, hi = E.tok_nsorted;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strncmp(E.tok_sorted[mid], prefix, plen) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int n = 0;
+  int counts[KILO_COMPLETE_MAX];
+  for (int j = lo; j < E.tok_nsorted; j++) {
+    char *key = E.tok_sorted[j];
+    if (strncmp(key, prefix, plen) != 0)
+      break;
+    int count = editorTokenCount(key);
+    if (count > 0 && (int)strlen(key) > plen)
+      tokenCandidate(key, count, out, counts, &n, max);
+  }
+  for (int j = E.tok_nsorted; j < E.tok_n; j++) {
+    char *key = E.tok_keys[j];
+    int count = editorTokenCount(key);
+    if (count > 0 && (int)strlen(key) > plen && !strncmp(key, prefix, plen))
+      tokenCandidate(key, count, out, counts, &n, max);
+  }
+  return n;
+}
+
+/*** soft wrap ***/
+// 非ASCIIの行は文字単位で折り返し、行末に収まらない全角文字は次の表示行に送る。
+// 表示行subの先頭の桁を返す。*linesには表示行数が入る
+int editorWrapScan(erow *row, int sub, int *lines) {
+  int k = 0;
+  int c = 0;
+  int ls = 0;
+  int start = 0;
+  for (int j = 0; j < row->rsize;) {
+    unsigned int cp;
+    j += kiloDecodeUtf8(&row->render[j], row->rsize - j, &cp);
+    int w = kiloCharWidth(cp);
+    if (c + w - ls > E.screencols && c > ls) {
+      ls = c;
+      if (++k == sub)
+        start = ls;
+    }
+    c += w;
+  }
+  if (k < sub)
+    start = ls;
+  if (lines)
+    *lines = k + 1;
+  return start;
+}
+// 折り返し表示したときにその行が占める画面上の行数
+int editorWrapLines(erow *row) {
+  if (row->rwidth == 0 || E.screencols <= 0)
+    return 1;
+  if (!row->ascii) {
+    if (row->wcols == E.screencols)
+      return row->wlines;
+    // 圧縮・追い出し中でrenderがなければ幅から見積もる
+    if (row->render == NULL)
+      return (row->rwidth + E.screencols - 1) / E.screencols;
+    editorWrapScan(row, 0, &row->wlines);
+    row->wcols = E.screencols;
+    return row->wlines;
+  }
+  return (row->rwidth + E.screencols - 1) / E.screencols;
+}
+// 表示行の木に載せる行数。隠れた行は0行、折り返さないときは1行
+int editorVisualLines(erow *row) {
+  if (row->hidden)
+    return 0;
+  return E.softwrap ? editorWrapLines(row) : 1;
+}
+// 表示行subの先頭の表示桁
+int editorWrapStart(erow *row, int sub) {
+  if (row->ascii || sub == 0 || row->render == NULL)
+    return sub * E.screencols;
+  return editorWrapScan(row, sub, NULL);
+}
+// 表示桁colを含む表示行
+int editorWrapSub(erow *row, int col) {
+  if (row->ascii || row->render == NULL)
+    return col / E.screencols;
+  int k = 0;
+  int c = 0;
+  int ls = 0;
+  for (int j = 0; j < row->rsize;) {
+    unsigned int cp;
+    j += kiloDecodeUtf8(&row->render[j], row->rsize - j, &cp);
+    int w = kiloCharWidth(cp);
+    if (c + w - ls > E.screencols && c > ls) {
+      if (c > col)
+        break;
+      ls = c;
+      k++;
+    }
+    c += w;
+  }
+  return k;
+}
+void editorWrapInvalidate() {
+  struct wrapIndex *w = E.wrap;
+  if (w == NULL)
+    return;
+  free(w->cnt);
+  free(w->bn);
+  free(w->bs);
+  free(w->tn);
+  free(w->ts);
+  free(w);
+  E.wrap = NULL;
+}
+// 塊の数が変わったときに塊の木を作り直す。塊の数は行数/KILO_WRAP_BLOCK程度
+void editorWrapBlocksBuild(struct wrapIndex *w) {
+  w->tn = realloc(w->tn, sizeof(int) * (w->bcap + 1));
+  w->ts = realloc(w->ts, sizeof(int) * (w->bcap + 1));
+  kiloFenwickBuild(w->tn, w->bn, w->nb);
+  kiloFenwickBuild(w->ts, w->bs, w->nb);
+}
+// 行ごとの表示行数を塊に分けて持つ。折りたたみがあれば折り返さないときも
+// 使う。画面幅・折り返しの切り替えや行の並べ替えで無効になり、次に使うときに
+// 作り直す。行の挿入・削除と表示行数の変化はその場で反映する
+void editorWrapBuild() {
+  if (E.wrap && E.wrap->n == E.numrows && E.wrap->cols == E.screencols)
+    return;
+  editorWrapInvalidate();
+  struct wrapIndex *w = calloc(1, sizeof(struct wrapIndex));
+  w->n = E.numrows;
+  w->cap = E.numrows ? E.numrows : 1;
+  w->cols = E.screencols;
+  w->cnt = malloc(sizeof(int) * w->cap);
+  w->bcap = (E.numrows + KILO_WRAP_BLOCK - 1) / KILO_WRAP_BLOCK + 1;
+  w->bn = malloc(sizeof(int) * w->bcap);
+  w->bs = malloc(sizeof(int) * w->bcap);
+  for (int i = 0; i < w->n; i++) {
+    w->cnt[i] = editorVisualLines(&E.row[i]);
+    if (i % KILO_WRAP_BLOCK == 0) {
+      w->bn[w->nb] = 0;
+      w->bs[w->nb++] = 0;
+    }
+    w->bn[w->nb - 1]++;
+    w->bs[w->nb - 1] += w->cnt[i];
+  }
+  editorWrapBlocksBuild(w);
+  E.wrap = w;
+}
+// 行atを含む塊を返す。*startにはその塊の先頭の行が入る。atが末尾なら最後の塊
+int editorWrapBlock(struct wrapIndex *w, int at, int *start) {
+  int off;
+  int b = kiloFenwickFind(w->tn, w->nb, at, &off);
+  if (b == w->nb) {
+    b--;
+    off = w->bn[b];
+  }
+  *start = at - off;
+  return b;
+}
+// 索引が今の画面幅のものでなければ捨てて0を返す
+int editorWrapValid() {
+  if (E.wrap == NULL)
+    return 0;
+  if (E.wrap->cols != E.screencols) {
+    editorWrapInvalidate();
+    return 0;
+  }
+  return 1;
+}
+// 行atの表示行数がdeltaだけ変わった
+void editorWrapUpdate(int at, int delta) {
+  if (delta == 0 || !editorWrapValid() || at >= E.wrap->n)
+    return;
+  struct wrapIndex *w = E.wrap;
+  int start;
+  int b = editorWrapBlock(w, at, &start);
+  w->cnt[at] += delta;
+  w->bs[b] += delta;
+  kiloFenwickAdd(w->ts, w->nb, b, delta);
+}
+// 行atにlines行の行が挿入された
+void editorWrapInsert(int at, int lines) {
+  if (!editorWrapValid())
+    return;
+  struct wrapIndex *w = E.wrap;
+  if (w->n == w->cap) {
+    w->cap *= 2;
+    w->cnt = realloc(w->cnt, sizeof(int) * w->cap);
+  }
+  memmove(&w->cnt[at + 1], &w->cnt[at], sizeof(int) * (w->n - at));
+  w->cnt[at] = lines;
+  w->n++;
+  if (w->nb == 0) {
+    w->bn[0] = 1;
+    w->bs[0] = lines;
+    w->nb = 1;
+    editorWrapBlocksBuild(w);
+    return;
+  }
+  int start;
+  int b = editorWrapBlock(w, at, &start);
+  w->bn[b]++;
+  w->bs[b] += lines;
+  if (w->bn[b] <= 2 * KILO_WRAP_BLOCK) {
+    kiloFenwickAdd(w->tn, w->nb, b, 1);
+    kiloFenwickAdd(w->ts, w->nb, b, lines);
+    return;
+  }
+  // 大きくなりすぎた塊を半分に分ける
+  if (w->nb == w->bcap) {
+    w->bcap *= 2;
+    w->bn = realloc(w->bn, sizeof(int) * w->bcap);
+    w->bs = realloc(w->bs, sizeof(int) * w->bcap);
+  }
+  memmove(&w->bn[b + 2], &w->bn[b + 1], sizeof(int) * (w->nb - b - 1));
+  memmove(&w->bs[b + 2], &w->bs[b + 1], sizeof(int) * (w->nb - b - 1));
+  w->nb++;
+  int half = w->bn[b] / 2;
+  int sum = 0;
+  for (int i = start; i < start + half; i++)
+    sum += w->cnt[i];
+  w->bn[b + 1] = w->bn[b] - half;
+  w->bs[b + 1] = w->bs[b] - sum;
+  w->bn[b] = half;
+  w->bs[b] = sum;
+  editorWrapBlocksBuild(w);
+}
+// 行atが削除された
+void editorWrapDelete(int at) {
+  if (!editorWrapValid() || at >= E.wrap->n)
+    return;
+  struct wrapIndex *w = E.wrap;
+  int start;
+  int b = editorWrapBlock(w, at, &start);
+  int lines = w->cnt[at];
+  memmove(&w->cnt[at], &w->cnt[at + 1], sizeof(int) * (w->n - at - 1));
+  w->n--;
+  w->bn[b]--;
+  w->bs[b] -= lines;
+  if (w->bn[b] > 0) {
+    kiloFenwickAdd(w->tn, w->nb, b, -1);
+    kiloFenwickAdd(w->ts, w->nb, b, -lines);
+    return;
+  }
+  // 空になった塊は取り除く
+  memmove(&w->bn[b], &w->bn[b + 1], sizeof(int) * (w->nb - b - 1));
+  memmove(&w->bs[b], &w->bs[b + 1], sizeof(int) * (w->nb - b - 1));
+  w->nb--;
+  editorWrapBlocksBuild(w);
+}
+// 行[0,at)の表示行数の合計
+int editorWrapPrefix(int at) {
+  editorWrapBuild();
+  struct wrapIndex *w = E.wrap;
+  if (at >= w->n)
+    return kiloFenwickPrefix(w->ts, w->nb);
+  int start;
+  int b = editorWrapBlock(w, at, &start);
+  int sum = kiloFenwickPrefix(w->ts, b);
+  for (int i = start; i < at; i++)
+    sum += w->cnt[i];
+  return sum;
+}
+// 表示行vを含む行を返す。*subにはその行の何番目の表示行かが入る
+int editorWrapFind(int v, int *sub) {
+  editorWrapBuild();
+  struct wrapIndex *w = E.wrap;
+  int rest;
+  int b = kiloFenwickFind(w->ts, w->nb, v, &rest);
+  if (b == w->nb) {
+    *sub = rest;
+    return w->n;
+  }
+  int at = kiloFenwickPrefix(w->tn, b);
+  while (rest >= w->cnt[at])
+    rest -= w->cnt[at++];
+  *sub = rest;
+  return at;
+}
+// カーソルのある表示行
+int editorWrapCursorLine() {
+  int v = editorWrapPrefix(E.cy);
+  if (E.softwrap && E.cy < E.numrows) {
+    int sub = editorWrapSub(&E.row[E.cy], E.rx);
+    int n = editorWrapLines(&E.row[E.cy]);
+    v += sub < n ? sub : n - 1;
+  }
+  return v;
+}
+
+/*** folding ***/
+// 見出し行の後ろのfolded行を隠し、見出しの1行だけを表示する。隠れた行は
+// 表示行の木で0行になるので、画面の行とファイルの行の変換はO(log n)で済む
+// 画面の行を表示行の木で引くか
+int editorVisualMap() { return E.softwrap || E.nfolds > 0; }
+void editorFoldSetHidden(int at, int hidden) {
+  erow *row = &E.row[at];
+  if (row->hidden == hidden)
+    return;
+  int old = editorVisualLines(row);
+  row->hidden = hidden;
+  editorWrapUpdate(at, editorVisualLines(row) - old);
+}
+// 隠れた行atを隠している見出し行
+int editorFoldHeader(int at) {
+  int sub;
+  return editorWrapFind(editorWrapPrefix(at) - 1, &sub);
+}
+// 行atの次・前の表示される行。隠れた行は木で飛ばす
+int editorFoldNext(int at) {
+  if (E.nfolds == 0 || at >= E.numrows)
+    return at + 1;
+  int sub;
+  return editorWrapFind(editorWrapPrefix(at) + editorVisualLines(&E.row[at]),
+                        &sub);
+}
+int editorFoldPrev(int at) {
+  if (E.nfolds == 0 || at == 0)
+    return at - 1;
+  int sub;
+  return editorWrapFind(editorWrapPrefix(at) - 1, &sub);
+}
+// 行at+1から行lastまでを隠す。中にある折りたたみは外側に吸収する
+void editorFold(int at, int last) {
+  int top = E.softwrap ? E.voff - editorWrapPrefix(E.rowoff) : 0;
+  for (int j = at + 1; j <= last; j++) {
+    if (E.row[j].folded) {
+      if (j + E.row[j].folded > last)
+        last = j + E.row[j].folded;
+      E.row[j].folded = 0;
+      E.nfolds--;
+    }
+    editorFoldSetHidden(j, 1);
+  }
+  E.row[at].folded = last - at;
+  E.nfolds++;
+  // 画面先頭の行は動かさない
+  E.voff = editorWrapPrefix(E.rowoff) + top;
+}
+void editorUnfold(int at) {
+  int top = E.softwrap ? E.voff - editorWrapPrefix(E.rowoff) : 0;
+  for (int j = at + 1; j <= at + E.row[at].folded; j++)
+    editorFoldSetHidden(j, 0);
+  E.row[at].folded = 0;
+  E.nfolds--;
+  E.voff = editorWrapPrefix(E.rowoff) + top;
+}
+// 行の並びが作り直されるときはすべて開く
+void editorFoldClear() {
+  if (E.nfolds == 0)
+    return;
+  for (int j = 0; j < E.numrows; j++) {
+    E.row[j].folded = 0;
+    E.row[j].hidden = 0;
+  }
+  E.nfolds = 0;
+  editorWrapInvalidate();
+}
+// 行頭の空白の表示幅。空白だけの行は-1
+int editorFoldIndent(erow *row) {
+  int j = 0;
+  while (j < row->rsize && row->render[j] == ' ')
+    j++;
+  return j == row->rsize ? -1 : j;
+}
+// カーソル行を見出しにして開閉する。行内で開いて後の行で閉じる括弧が
+// あれば閉じ括弧の手前までを、なければ字下げが深い行の続く範囲を畳む
+void editorToggleFold() {
+  if (E.cy >= E.numrows)
+    return;
+  if (E.row[E.cy].folded) {
+    int n = E.row[E.cy].folded;
+    editorUnfold(E.cy);
+    editorSetStatusMessage("Unfolded %d lines", n);
+    return;
+  }
+  int last = -1;
+  // 括弧の位置はハイライトから拾うので、後回しの分を先に済ませる
+  editorSyntaxFlush();
+  erow *row = editorRowAt(E.cy);
+  for (int k = row->nbr - 1; k >= 0; k--) {
+    int mrow, mrx;
+    if (row->br[k] >= row->rsize)
+      continue;
+    if (editorBracketDir(row->render[row->br[k]]) > 0 &&
+        editorFindBracketMatch(E.cy, row->br[k], &mrow, &mrx) &&
+        mrow > E.cy + 1) {
+      last = mrow - 1;
+      break;
+    }
+    row = editorRowAt(E.cy);
+  }
+  if (last < 0) {
+    int base = editorFoldIndent(editorRowAt(E.cy));
+    for (int j = E.cy + 1; j < E.numrows && base >= 0; j++) {
+      int ind = editorFoldIndent(editorRowAt(j));
+      if (ind >= 0 && ind <= base)
+        break;
+      if (ind > base)
+        last = j;
+    }
+  }
+  if (last < 0) {
+    editorSetStatusMessage("Nothing to fold");
+    return;
+  }
+  editorFold(E.cy, last);
+  editorSetStatusMessage("Folded %d lines", last - E.cy);
+}
+
+/*** row operations ***/
+// カーソルなどの詳細は忘れるが、row操作の詳細は記述される
+// cxの表示桁。タブも非ASCIIもない行ではそのまま
+int editorRowCxToRx(erow *row, int cx) {
+  if (row->ascii && row->rsize == row->size)
+    return cx;
+  int rx = 0;
+  int j = 0;
+  while (j < cx && j < row->size) {
+    if (row->chars[j] == '\t') {
+      rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+      j++;
+    } else if ((unsigned char)row->chars[j] < 0x80) {
+      rx++;
+      j++;
+    } else {
+      unsigned int cp;
+      j += kiloDecodeUtf8(&row->chars[j], row->size - j, &cp);
+      rx += kiloCharWidth(cp);
+    }
+  }
+  return rx;
+}
+int editorRowRxToCx(erow *row, int rx) {
+  if (row->ascii && row->rsize == row->size)
+    return rx < row->size ? rx : row->size;
+  int cur_rx = 0;
+  int cx = 0;
+  while (cx < row->size) {
+    int n = 1;
+    if (row->chars[cx] == '\t') {
+      cur_rx += KILO_TAB_STOP - (cur_rx % KILO_TAB_STOP);
+    } else if ((unsigned char)row->chars[cx] < 0x80) {
+      cur_rx++;
+    } else {
+      unsigned int cp;
+      n = kiloDecodeUtf8(&row->chars[cx], row->size - cx, &cp);
+      cur_rx += kiloCharWidth(cp);
+    }
+    if (cur_rx > rx)
+      return cx;
+    cx += n;
+  }
+  return cx;
+}
+
+// FNV-1a。行の同一性判定に使う
+uint64_t editorHashBytes(const char *s, int len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (int j = 0; j < len; j++) {
+    h ^= (unsigned char)s[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// 行が確保しているヒープの量を全体の集計に反映する
+void editorRowAccount(erow *row) {
+  int mem = 0;
+  if (row->chars)
+    mem += row->size + 1;
+  if (row->render)
+    mem += row->rsize + 1;
+  if (row->hl)
+    mem += row->rsize;
+  mem += row->nbr * sizeof(int);
+  E.mem_used += mem - row->mem;
+  row->mem = mem;
+}
+
+// タブを展開してrenderを作り直す
+void editorUpdateRender(erow *row) {
+  int old_wrap = editorVisualLines(row);
+  uint64_t old_hash = row->hash;
+  int tabs = 0;
+  row->ascii = kiloScanAscii(row->chars, row->size, &tabs);
+  free(row->render);
+  row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+  int idx = kiloExpandTabs(row->chars, row->size, row->ascii, row->render,
+                           &row->rwidth);
+  row->rsize = idx;
+  row->wcols = 0;
+  row->hash = editorHashBytes(row->chars, row->size);
+  if (row->hash != old_hash)
+    editorGutterDirty(row->idx, row->idx + 1);
+  editorWrapUpdate(row->idx, editorVisualLines(row) - old_wrap);
+}
+
+void editorUpdateRow(erow *row) {
+  editorUpdateRender(row);
+  editorUpdateSyntax(row);
+  editorRowAccount(row);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at > E.numrows || at < 0)
+    return;
+  // 折りたたまれた範囲の中に挿入するときは開く
+  if (at < E.numrows && E.row[at].hidden)
+    editorUnfold(editorFoldHeader(at));
+  editorGutterShift(at, 1);
+  // 圧縮ブロックの途中に挿入するとブロックが分かれるので先に展開する
+  if (at > 0 && at < E.numrows && E.row[at].cold &&
+      E.row[at].cold == E.row[at - 1].cold)
+    editorRowTouch(&E.row[at]);
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+  for (int j = at + 1; j <= E.numrows; j++)
+    E.row[j].idx++;
+  E.row[at].idx = at;
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  // 最下の列の長さを取得している。// そもそもここには存在しないはずでは？
+  E.row[at].size = len;
+  // それにプラス1をしてメモリ確保？？--2
+  E.row[at].chars = malloc(len + 1);
+  // そこにsをコピー
+  memcpy(E.row[at].chars, s, len);
+  // これが--2の理由か。。。
+  E.row[at].chars[len] = '\0';
+
+  E.row[at].rsize = 0;
+  E.row[at].ascii = 1;
+  E.row[at].rwidth = 0;
+  E.row[at].wcols = 0;
+  E.row[at].render = NULL;
+  E.row[at].hl = NULL;
+  E.row[at].hl_open_comment = 0;
+  E.row[at].cold = NULL;
+  E.row[at].cold_i = 0;
+  E.row[at].mem = 0;
+  E.row[at].touched = E.tick;
+  E.row[at].br = NULL;
+  E.row[at].nbr = 0;
+  E.row[at].br_sum = 0;
+  E.row[at].br_minpre = 0;
+  E.row[at].br_maxsuf = 0;
+  E.row[at].tok_counted = 0;
+  E.row[at].hl_stale = 0;
+  E.row[at].folded = 0;
+  E.row[at].hidden = 0;
+  E.row[at].hash = 0;
+  E.row[at].bidx = -1;
+  E.row[at].gut = 0;
+  E.row[at].foff = -1;
+  E.row[at].lost = 0;
+  // 中身のない見える行として索引に入れ、表示行数は作ったときに直す
+  editorWrapInsert(at, 1);
+  editorBracketInsert(at);
+  editorUpdateRow(&E.row[at]);
+  E.numrows++;
+  E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+  free(row->render);
+  free(row->chars);
+  free(row->hl);
+  free(row->br);
+  E.mem_used -= row->mem;
+  row->mem = 0;
+}
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows)
+    return;
+  if (E.row[at].hidden)
+    editorUnfold(editorFoldHeader(at));
+  if (E.row[at].folded)
+    editorUnfold(at);
+  editorRowTouch(&E.row[at]);
+  editorTokenRemoveRow(&E.row[at]);
+  editorFreeRow(&E.row[at]);
+  editorWrapDelete(at);
+  editorBracketDelete(at);
+  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  for (int j = at; j < E.numrows - 1; j++)
+    E.row[j].idx--;
+  E.numrows--;
+  if (E.hl_lo > at)
+    E.hl_lo--;
+  if (E.tok_scan > at)
+    E.tok_scan--;
+  editorGutterShift(at, -1);
+  E.dirty++;
+}
+// E.rowに挿入
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) {
+    at = row->size;
+  }
+  editorRowTouch(row);
+  editorTokenRemoveRow(row);
+  // 末尾とnull byteの領域を新たに確保する。
+  row->chars = realloc(row->chars, row->size + 2);
+  // null byte用の領域も合わせてコピー
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  // nullの領域はサイズに加味しない
+  row->size++;
+  row->chars[at] = c;
+  // rsizeとrender を更新する
+  editorUpdateRow(row);
+  E.dirty++;
+}
+void editorInsertNewline() {
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    erow *row = editorRowAt(E.cy);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = &E.row[E.cy];
+    editorTokenRemoveRow(row);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowTouch(row);
+  editorTokenRemoveRow(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+}
+// 行の内容をまるごと置き換える
+void editorRowSetString(erow *row, char *s, size_t len) {
+  editorRowTouch(row);
+  editorTokenRemoveRow(row);
+  free(row->chars);
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->size = len;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+// atからlenバイトを消す。行の作り直しは一度だけにする
+void editorRowDelChars(erow *row, int at, int len) {
+  if (at < 0 || len <= 0 || at + len > row->size)
+    return;
+  editorRowTouch(row);
+  editorTokenRemoveRow(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+void editorRowDelChar(erow *row, int at) { editorRowDelChars(row, at, 1); }
+/*** lz ***/
+// 冷えた行のブロックを圧縮する小さなLZ77系のコーデック。
+// [token][リテラル長の続き][リテラル][オフセット2byte][一致長の続き]を繰り返す。
+// tokenの上位4bitがリテラル長、下位4bitが一致長-4で、15なら続きのバイトを足す。
+// 最後の組はリテラルだけで終わる。
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+int lzBound(int n) { return n + n / 255 + 16; }
+uint32_t lzRead32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+char *lzPutLen(char *op, int len) {
+  while (len >= 255) {
+    *op++ = (char)255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+char *lzPutLiterals(char *op, const char *lit, int len, int mcode) {
+  *op++ = (len >= 15 ? 15 : len) << 4 | mcode;
+  if (len >= 15)
+    op = lzPutLen(op, len - 15);
+  memcpy(op, lit, len);
+  return op + len;
+}
+// dstにはlzBound(n)バイト必要。圧縮後の長さを返す
+int lzCompress(const char *src, int n, char *dst) {
+  int table[1 << LZ_HASH_BITS];
+  for (int j = 0; j < (1 << LZ_HASH_BITS); j++)
+    table[j] = -1;
+  char *op = dst;
+  int ip = 0, anchor = 0;
+  while (ip + LZ_MIN_MATCH <= n) {
+    uint32_t seq = lzRead32(src + ip);
+    int h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref < 0 || ip - ref > 65535 || lzRead32(src + ref) != seq) {
+      ip++;
+      continue;
+    }
+    int mlen = LZ_MIN_MATCH;
+    while (ip + mlen < n && src[ref + mlen] == src[ip + mlen])
+      mlen++;
+    int mcode = mlen - LZ_MIN_MATCH;
+    op = lzPutLiterals(op, src + anchor, ip - anchor, mcode >= 15 ? 15 : mcode);
+    *op++ = (ip - ref) & 0xff;
+    *op++ = (ip - ref) >> 8;
+    if (mcode >= 15)
+      op = lzPutLen(op, mcode - 15);
+    ip += mlen;
+    anchor = ip;
+  }
+  op = lzPutLiterals(op, src + anchor, n - anchor, 0);
+  return op - dst;
+}
+// 展開後の長さを返す。壊れたデータなら-1
+int lzDecompress(const char *src, int clen, char *dst, int cap) {
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *end = ip + clen;
+  char *op = dst;
+  int b;
+  while (ip < end) {
+    int token = *ip++;
+    int lit = token >> 4;
+    if (lit == 15) {
+      do {
+        b = *ip++;
+        lit += b;
+      } while (b == 255 && ip < end);
+    }
+    if (lit > end - ip || lit > cap - (op - dst))
+      return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip >= end)
+      break;
+    if (end - ip < 2)
+      return -1;
+    int off = ip[0] | ip[1] << 8;
+    ip += 2;
+    int mlen = (token & 15) + LZ_MIN_MATCH;
+    if ((token & 15) == 15) {
+      do {
+        b = *ip++;
+        mlen += b;
+      } while (b == 255 && ip < end);
+    }
+    if (off == 0 || off > op - dst || mlen > cap - (op - dst))
+      return -1;
+    char *ref = op - off;
+    while (mlen--)
+      *op++ = *ref++;
+  }
+  return op - dst;
+}
+
+/*** search ***/
+// hayの中からneedleを探す。SSE2があれば先頭と末尾のバイトが一致する位置を
+// 16バイトずつまとめて絞り込み、候補だけをmemcmpで確かめる
+const char *kiloMemmem(const char *hay, size_t n, const char *needle,
+                       size_t m) {
+  if (m == 0)
+    return hay;
+  if (m > n)
+    return NULL;
+  if (m == 1)
+    return memchr(hay, needle[0], n);
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m + 15 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  for (; i + m <= n; i++) {
+    if (hay[i] == needle[0] && memcmp(hay + i, needle, m) == 0)
+      return hay + i;
+  }
+  return NULL;
+#else
+  return memmem(hay, n, needle, m);
+#endif
+}
+// [s, s+n)に含まれる改行の数
+size_t kiloCountNewlines(const char *s, size_t n) {
+  size_t count = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)));
+  }
+#endif
+  for (; i < n; i++)
+    count += s[i] == '\n';
+  return count;
+}
+
+// [s, s+n)の最初の改行。なければNULL
+const char *kiloFindNewline(const char *s, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, nl));
+    if (mask)
+      return s + i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < n; i++)
+    if (s[i] == '\n')
+      return s + i;
+  return NULL;
+}
+
+/*** cold rows ***/
+// 画面から遠く、しばらく編集されていない行をKILO_BLOCK_ROWS行ずつ圧縮して
+// メモリ予算(E.mem_budget)に収める。圧縮された行は触ったときに展開される。
+
+// rows [at, at+n)をひとつのブロックに圧縮する
+void editorFreezeRows(int at, int n) {
+  struct coldBlock *b = malloc(sizeof(struct coldBlock));
+  int raw = 0;
+  int j;
+  for (j = at; j < at + n; j++)
+    raw += E.row[j].size;
+  char *buf = malloc(raw + 1);
+  char *p = buf;
+  // 追い出された行が紛れてもファイルから読めるようにPeekで集める
+  for (j = at; j < at + n; j++) {
+    memcpy(p, editorRowPeek(&E.row[j]), E.row[j].size);
+    p += E.row[j].size;
+  }
+  *p = '\0';
+  char *dst = malloc(lzBound(raw));
+  b->clen = lzCompress(buf, raw, dst);
+  b->data = realloc(dst, b->clen);
+  b->rawlen = raw;
+  b->nrows = n;
+  b->id = ++E.cold_ids;
+  free(buf);
+  for (j = at; j < at + n; j++) {
+    erow *row = &E.row[j];
+    free(row->chars);
+    free(row->render);
+    free(row->hl);
+    free(row->br);
+    row->chars = NULL;
+    row->render = NULL;
+    row->hl = NULL;
+    row->br = NULL;
+    row->nbr = 0;
+    row->cold = b;
+    row->cold_i = j - at;
+    E.mem_used -= row->mem;
+    row->mem = 0;
+  }
+  E.mem_used += b->clen + sizeof(struct coldBlock);
+  E.cold_blocks++;
+  E.cold_raw += raw;
+  E.cold_bytes += b->clen;
+}
+
+// rowを含むブロックを展開し、ブロック内の全行にcharsを戻す。render/hlは
+// 作らず、それぞれの行を触ったときに作る。ブロックの先頭の行を返す
+int editorColdDetach(erow *row) {
+  struct coldBlock *b = row->cold;
+  int first = row->idx - row->cold_i;
+  char *buf = malloc(b->rawlen + 1);
+  if (lzDecompress(b->data, b->clen, buf, b->rawlen) != b->rawlen)
+    die("lzDecompress");
+  int off = 0;
+  for (int j = first; j < first + b->nrows; j++) {
+    erow *r = &E.row[j];
+    r->chars = malloc(r->size + 1);
+    memcpy(r->chars, &buf[off], r->size);
+    r->chars[r->size] = '\0';
+    off += r->size;
+    r->cold = NULL;
+    editorRowAccount(r);
+  }
+  free(buf);
+  E.mem_used -= b->clen + sizeof(struct coldBlock);
+  E.cold_blocks--;
+  E.cold_raw -= b->rawlen;
+  E.cold_bytes -= b->clen;
+  free(b->data);
+  free(b);
+  return first;
+}
+// rowを含むブロックを展開し、ブロック内の全行のrender/hlを作り直す
+void editorRowThaw(erow *row) {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int n = row->cold->nrows;
+  int first = editorColdDetach(row);
+  int j;
+  // 構文ハイライトは次の行に波及することがあるので全行のrenderを先に作る
+  for (j = first; j < first + n; j++)
+    editorUpdateRender(&E.row[j]);
+  for (j = first; j < first + n; j++) {
+    editorUpdateSyntax(&E.row[j]);
+    editorRowAccount(&E.row[j]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+  E.thaws++;
+  E.thaw_total_us += us;
+  if (us > E.thaw_max_us)
+    E.thaw_max_us = us;
+}
+
+// 追い出されたcharsをファイルから読み戻す
+// 読めなければ空白で埋め、保存はさせずに読み直しを待つ。ハッシュも埋めた内容に
+// 合わせ、読み直しのときにディスクの行と同じとみなさないようにする
+void editorRowReadBack(erow *row, char *buf) {
+  buf[row->size] = '\0';
+  if (pread(E.fd, buf, row->size, row->foff) == row->size &&
+      editorHashBytes(buf, row->size) == row->hash)
+    return;
+  memset(buf, ' ', row->size);
+  row->hash = editorHashBytes(buf, row->size);
+  if (!row->lost) {
+    row->lost = 1;
+    E.lost++;
+  }
+  editorSetStatusMessage(
+      "File changed on disk: %d lines lost, saving disabled until reload",
+      E.lost);
+}
+
+// 行を使う前に呼ぶ。圧縮されていれば展開し、追い出されていれば作り直す
+void editorRowTouch(erow *row) {
+  if (row->cold) {
+    editorRowThaw(row);
+  } else if (row->chars == NULL || row->render == NULL) {
+    if (row->chars == NULL) {
+      row->chars = malloc(row->size + 1);
+      editorRowReadBack(row, row->chars);
+    }
+    editorUpdateRender(row);
+    editorUpdateSyntax(row);
+    editorRowAccount(row);
+  }
+  row->touched = E.tick;
+}
+erow *editorRowAt(int at) {
+  editorRowTouch(&E.row[at]);
+  return &E.row[at];
+}
+
+// 展開せずに行の内容を読む(検索や保存用)。次の呼び出しまで有効な文字列を返す。
+// 圧縮された行は直前に展開したブロックを覚えておき、追い出された行はファイルから読む
+char *editorRowPeek(erow *row) {
+  static unsigned int last_id = 0;
+  static char *raw = NULL;
+  static char *line = NULL;
+  if (row->chars)
+    return row->chars;
+  line = realloc(line, row->size + 1);
+  if (row->cold == NULL) {
+    editorRowReadBack(row, line);
+    return line;
+  }
+  struct coldBlock *b = row->cold;
+  if (b->id != last_id) {
+    raw = realloc(raw, b->rawlen + 1);
+    lzDecompress(b->data, b->clen, raw, b->rawlen);
+    last_id = b->id;
+  }
+  int off = 0;
+  for (int j = row->idx - row->cold_i; j < row->idx; j++)
+    off += E.row[j].size;
+  memcpy(line, &raw[off], row->size);
+  line[row->size] = '\0';
+  return line;
+}
+
+int editorRowIsCold(int at, int lo, int hi) {
+  erow *row = &E.row[at];
+  // 追い出された行(charsがNULL)はこれ以上小さくならないので圧縮しない
+  if (row->cold || row->chars == NULL || (at >= lo && at < hi))
+    return 0;
+  return row->touched == 0 || E.tick - row->touched >= KILO_COLD_AGE;
+}
+// 予算を超えていれば前回の続きから冷えた行を探して圧縮する
+void editorEnforceBudget() {
+  if (E.mem_budget == 0 || E.mem_used <= E.mem_budget)
+    return;
+  // 裏のバッファから先に追い出す
+  editorEvictBackground();
+  // 前の一巡で何も圧縮できず、その後メモリ量が変わらず行も冷えていなければ
+  // 探し直さない
+  if (E.mem_used == E.sweep_dry && E.tick - E.sweep_tick < KILO_COLD_AGE)
+    return;
+  int lo = E.rowoff - E.screenrows * 2;
+  int hi = E.rowoff + E.screenrows * 3;
+  int scanned = 0;
+  int frozen = 0;
+  while (E.mem_used > E.mem_budget && scanned < E.numrows) {
+    if (E.sweep >= E.numrows)
+      E.sweep = 0;
+    int at = E.sweep;
+    int n = 0;
+    while (at + n < E.numrows && n < KILO_BLOCK_ROWS &&
+           editorRowIsCold(at + n, lo, hi))
+      n++;
+    if (n > 0)
+      editorFreezeRows(at, n);
+    E.sweep = at + (n ? n : 1);
+    scanned += n ? n : 1;
+    frozen += n;
+  }
+  if (frozen == 0 && E.mem_used > E.mem_budget) {
+    E.sweep_dry = E.mem_used;
+    E.sweep_tick = E.tick;
+  }
+}
+
+void editorShowMemoryStats() {
+  double ratio = E.cold_bytes ? (double)E.cold_raw / E.cold_bytes : 0;
+  double avg = E.thaws ? E.thaw_total_us / E.thaws : 0;
+  editorSetStatusMessage(
+      "mem %zuK/%zuK | %d cold blk %.1fx | %ld thaw avg %.0fus max %.0fus",
+      E.mem_used / 1024, E.mem_budget / 1024, E.cold_blocks, ratio, E.thaws,
+      avg, E.thaw_max_us);
+}
+
+// editor
+// operations(row操作の詳細を忘れるが、カーソルに関しては詳細に記述される)
+
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+  E.cx++;
+}
+void editorDelChar() {
+  if (E.cy == E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0) {
+    // UTF-8の文字は続きのバイトごと消す
+    int start = E.cx - 1;
+    while (start > 0 && (row->chars[start] & 0xc0) == 0x80)
+      start--;
+    editorRowDelChars(row, start, E.cx - start);
+    E.cx = start;
+  } else {
+    // 前の行が折りたたまれていれば、隠れた行に足さないよう先に開く
+    if (E.row[E.cy - 1].hidden)
+      editorUnfold(editorFoldHeader(E.cy - 1));
+    E.cx = E.row[E.cy - 1].size;
+    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+/*** diff ***/
+// 差分の1区間。旧[a0,a1)が新[b0,b1)に置き換わる
+typedef struct diffHunk {
+  int a0, a1;
+  int b0, b1;
+} diffHunk;
+
+// Myersの差分アルゴリズムでハッシュ列aとbを比較し、変更区間を昇順に返す。
+// 編集距離がmax_dを超えたら-1を返す。
+int diffHashes(const uint64_t *a, int n, const uint64_t *b, int m, int max_d,
+               diffHunk **hunks) {
+  *hunks = NULL;
+  if (max_d > n + m)
+    max_d = n + m;
+  int off = max_d + 1;
+  int *v = malloc(sizeof(int) * (2 * max_d + 3));
+  // trace[d]にはd手目のvのうちk=-d..dの部分を保存する
+  int **trace = malloc(sizeof(int *) * (max_d + 1));
+  int d, k, found = -1;
+  v[off + 1] = 0;
+  for (d = 0; d <= max_d && found < 0; d++) {
+    for (k = -d; k <= d; k += 2) {
+      int x;
+      if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+        x = v[off + k + 1];
+      else
+        x = v[off + k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      v[off + k] = x;
+      if (x >= n && y >= m) {
+        found = d;
+        break;
+      }
+    }
+    trace[d] = malloc(sizeof(int) * (2 * d + 1));
+    memcpy(trace[d], &v[off - d], sizeof(int) * (2 * d + 1));
+  }
+  int steps = d;
+  free(v);
+  if (found < 0) {
+    for (d = 0; d < steps; d++)
+      free(trace[d]);
+    free(trace);
+    return -1;
+  }
+
+  // 終点から戻りながら一致した斜めの区間(snake)を集める
+  int *snake = malloc(sizeof(int) * 3 * (found + 1));
+  int nsnake = 0;
+  int x = n, y = m;
+  for (d = found; d > 0; d--) {
+    int *pv = trace[d - 1];
+    k = x - y;
+    int pk;
+    if (k == -d || (k != d && pv[k - 1 + d - 1] < pv[k + 1 + d - 1]))
+      pk = k + 1;
+    else
+      pk = k - 1;
+    int px = pv[pk + d - 1];
+    int py = px - pk;
+    int sx = (pk == k + 1) ? px : px + 1;
+    snake[nsnake * 3] = sx;
+    snake[nsnake * 3 + 1] = sx - k;
+    snake[nsnake * 3 + 2] = x - sx;
+    nsnake++;
+    x = px;
+    y = py;
+  }
+  snake[nsnake * 3] = 0;
+  snake[nsnake * 3 + 1] = 0;
+  snake[nsnake * 3 + 2] = x;
+  nsnake++;
+
+  // snakeの間が変更区間になる
+  int nhunks = 0;
+  int pa = 0, pb = 0;
+  *hunks = malloc(sizeof(diffHunk) * (nsnake + 1));
+  for (int j = nsnake - 1; j >= -1; j--) {
+    int sx = j >= 0 ? snake[j * 3] : n;
+    int sy = j >= 0 ? snake[j * 3 + 1] : m;
+    if (sx > pa || sy > pb) {
+      diffHunk *h = &(*hunks)[nhunks++];
+      h->a0 = pa;
+      h->a1 = sx;
+      h->b0 = pb;
+      h->b1 = sy;
+    }
+    if (j >= 0) {
+      pa = sx + snake[j * 3 + 2];
+      pb = sy + snake[j * 3 + 2];
+    }
+  }
+  free(snake);
+  for (d = 0; d <= found; d++)
+    free(trace[d]);
+  free(trace);
+  return nhunks;
+}
+
+// 追い出した行を読み戻すためのファイルを開き直す
+void editorReopenFile() {
+  if (E.fd != -1)
+    close(E.fd);
+  E.fd = E.filename ? open(E.filename, O_RDONLY | O_CLOEXEC) : -1;
+}
+
+/*** gutter ***/
+// 行ごとに保存版の対応する行(bidx)を覚えておき、変わった範囲の前後で
+// まだ対応の取れている行に挟まれた区間だけを保存版と比べ直す
+// 行[lo,hi)が変わった
+void editorGutterDirty(int lo, int hi) {
+  if (E.gut_lo < 0) {
+    E.gut_lo = lo;
+    E.gut_hi = hi;
+    return;
+  }
+  if (lo < E.gut_lo)
+    E.gut_lo = lo;
+  if (hi > E.gut_hi)
+    E.gut_hi = hi;
+}
+// 行atに1行挿入された(delta=1)か、行atが削除された(delta=-1)
+void editorGutterShift(int at, int delta) {
+  if (E.gut_lo >= 0) {
+    if (E.gut_lo > at || (delta > 0 && E.gut_lo == at))
+      E.gut_lo += delta;
+    if (E.gut_hi > at)
+      E.gut_hi += delta;
+  }
+  editorGutterDirty(at, delta > 0 ? at + 1 : at);
+}
+// 今の内容を保存版にする。開いたときと保存・再読み込みのあとに呼ぶ
+void editorGutterReset() {
+  E.base = realloc(E.base, sizeof(uint64_t) * (E.numrows ? E.numrows : 1));
+  for (int j = 0; j < E.numrows; j++) {
+    E.base[j] = E.row[j].hash;
+    E.row[j].bidx = j;
+    E.row[j].gut = GUT_NONE;
+  }
+  E.base_n = E.numrows;
+  E.gut_lo = -1;
+  E.gut_tail = GUT_NONE;
+}
+// 行jが保存版の行bidxと同じ内容のままか
+int editorGutterAnchor(int j) {
+  erow *row = &E.row[j];
+  return row->bidx >= 0 && row->hash == E.base[row->bidx];
+}
+// 対応の取れている行aとbの間(-1とnumrowsはファイルの端)を保存版と比べる
+void editorGutterDiff(int a, int b) {
+  int b0 = a >= 0 ? E.row[a].bidx + 1 : 0;
+  int b1 = b < E.numrows ? E.row[b].bidx : E.base_n;
+  int n = b1 - b0;
+  int m = b - a - 1;
+  uint64_t *cur = malloc(sizeof(uint64_t) * (m + 1));
+  for (int j = 0; j < m; j++) {
+    erow *row = &E.row[a + 1 + j];
+    cur[j] = row->hash;
+    row->bidx = -1;
+    row->gut = GUT_NONE;
+  }
+  int *mark = b < E.numrows ? &E.row[b].gut : &E.gut_tail;
+  *mark = GUT_NONE;
+  diffHunk *hunks;
+  int nhunks = diffHashes(&E.base[b0], n, cur, m, KILO_DIFF_MAX_D, &hunks);
+  free(cur);
+  if (nhunks < 0) {
+    hunks = malloc(sizeof(diffHunk));
+    hunks->a0 = 0;
+    hunks->a1 = n;
+    hunks->b0 = 0;
+    hunks->b1 = m;
+    nhunks = (n || m) ? 1 : 0;
+  }
+  // 区間の間は一致した行。区間では先頭から置き換えた行、残りを追加した
+  // 行とし、削除だけが残るときは直後の行(末尾ならファイルの後ろ)に印を付ける
+  int pa = 0, pb = 0;
+  for (int h = 0; h <= nhunks; h++) {
+    int a0 = h < nhunks ? hunks[h].a0 : n;
+    int c0 = h < nhunks ? hunks[h].b0 : m;
+    for (; pb < c0; pa++, pb++)
+      E.row[a + 1 + pb].bidx = b0 + pa;
+    if (h == nhunks)
+      break;
+    // 削除と挿入が隣り合う区間は1つの置き換えにまとめる
+    int a1 = hunks[h].a1, c1 = hunks[h].b1;
+    while (h + 1 < nhunks && hunks[h + 1].a0 == a1 && hunks[h + 1].b0 == c1) {
+      h++;
+      a1 = hunks[h].a1;
+      c1 = hunks[h].b1;
+    }
+    int del = a1 - a0;
+    for (; pb < c1; pb++, del--)
+      E.row[a + 1 + pb].gut = del > 0 ? GUT_CHANGE : GUT_ADD;
+    if (del > 0 && pb == m)
+      *mark = GUT_DEL;
+    else if (del > 0)
+      E.row[a + 1 + pb].gut = GUT_DEL;
+    pa = a1;
+  }
+  free(hunks);
+}
+// 入力待ちの間に呼ばれる。変わった範囲の中でも保存版と同じ並びのままの
+// 行は飛ばし、対応の取れている行に挟まれた隙間だけを比べる。deadlineを
+// 過ぎたら続きを残して戻る。比べるものがなければ0を返す
+int editorGutterUpdate(long long deadline) {
+  if (E.gut_lo < 0 || E.grep_results)
+    return 0;
+  int a = E.gut_lo - 1;
+  while (a >= 0 && !editorGutterAnchor(a))
+    a--;
+  int hi = E.gut_hi < E.numrows ? E.gut_hi : E.numrows;
+  for (;;) {
+    int b = a + 1;
+    while (b < E.numrows && !editorGutterAnchor(b))
+      b++;
+    int ba = a >= 0 ? E.row[a].bidx : -1;
+    int bb = b < E.numrows ? E.row[b].bidx : E.base_n;
+    if (b > a + 1 || bb != ba + 1)
+      editorGutterDiff(a, b);
+    else if (b < E.numrows)
+      E.row[b].gut = GUT_NONE;
+    else
+      E.gut_tail = GUT_NONE;
+    if (b >= hi)
+      break;
+    a = b;
+    if (kiloNowUs() >= deadline) {
+      E.gut_lo = a + 1;
+      return 1;
+    }
+  }
+  E.gut_lo = -1;
+  return 1;
+}
+
+/*** index cache ***/
+// 大きいファイルを開いたときと保存したときに、行の位置・ハッシュ・表示幅・
+// 括弧の集計・複数行コメントの状態を隣の.<名前>.kilo-indexに書いておく。
+// 次に開くときはこれをmmapして中身を読まずに行を作り、触った行だけを読む。
+// 大きさ・更新時刻・標本のハッシュ・構文が一致しなければ使わない
+struct cacheHeader {
+  char magic[8];
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t sample;
+  int32_t syntax;
+  int32_t nrows;
+};
+struct cacheRow {
+  int64_t foff;
+  uint64_t hash;
+  int32_t size;
+  int32_t rsize;
+  int32_t rwidth;
+  int32_t br_sum;
+  int32_t br_minpre;
+  int32_t br_maxsuf;
+  unsigned char ascii;
+  unsigned char hl_open_comment;
+  unsigned char pad[6];
+};
+#define KILO_CACHE_MAGIC "KILOIDX1"
+
+char *editorCachePath(const char *filename) {
+  const char *base = strrchr(filename, '/');
+  int dirlen = base ? base - filename + 1 : 0;
+  base = base ? base + 1 : filename;
+  char *path = malloc(dirlen + strlen(base) + 16);
+  sprintf(path, "%.*s.%s.kilo-index", dirlen, filename, base);
+  return path;
+}
+// ファイル全体に散らばったブロックのハッシュ
+uint64_t kiloSampleHash(int fd, off_t size) {
+  char buf[KILO_CACHE_SAMPLE_SIZE];
+  uint64_t h = 0;
+  for (int j = 0; j < KILO_CACHE_SAMPLES; j++) {
+    off_t at = size * j / (KILO_CACHE_SAMPLES - 1);
+    if (at > size - KILO_CACHE_SAMPLE_SIZE)
+      at = size - KILO_CACHE_SAMPLE_SIZE;
+    if (at < 0)
+      at = 0;
+    ssize_t n = pread(fd, buf, sizeof(buf), at);
+    if (n < 0)
+      n = 0;
+    h = h * 1099511628211ULL ^ editorHashBytes(buf, n);
+  }
+  return h;
+}
+int editorCacheSyntax() { return E.syntax ? (int)(E.syntax - HLDB) : -1; }
+// 開いているファイルの索引を書く。E.fdが開いている必要がある
+void editorCacheWrite() {
+  editorSyntaxFlush();
+  struct stat st;
+  if (E.filename == NULL || E.fd == -1 || fstat(E.fd, &st) == -1 ||
+      st.st_size < KILO_CACHE_MIN)
+    return;
+  char *path = editorCachePath(E.filename);
+  char *tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp) {
+    struct cacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, KILO_CACHE_MAGIC, sizeof(h.magic));
+    h.size = st.st_size;
+    h.mtime_sec = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.sample = kiloSampleHash(E.fd, st.st_size);
+    h.syntax = editorCacheSyntax();
+    h.nrows = E.numrows;
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    for (int j = 0; j < E.numrows && ok; j++) {
+      erow *row = &E.row[j];
+      struct cacheRow cr;
+      memset(&cr, 0, sizeof(cr));
+      cr.foff = row->foff;
+      cr.hash = row->hash;
+      cr.size = row->size;
+      cr.rsize = row->rsize;
+      cr.rwidth = row->rwidth;
+      cr.br_sum = row->br_sum;
+      cr.br_minpre = row->br_minpre;
+      cr.br_maxsuf = row->br_maxsuf;
+      cr.ascii = row->ascii;
+      cr.hl_open_comment = row->hl_open_comment;
+      ok = fwrite(&cr, sizeof(cr), 1, fp) == 1;
+    }
+    if (fclose(fp) == 0 && ok)
+      rename(tmp, path);
+    else
+      unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+}
+// 索引が使えれば行を作って1を返す。行の中身は触ったときにE.fdから読む
+int editorCacheLoad(const char *filename) {
+  struct stat st, cst;
+  if (stat(filename, &st) == -1 || st.st_size < KILO_CACHE_MIN)
+    return 0;
+  char *path = editorCachePath(filename);
+  int cfd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (cfd == -1)
+    return 0;
+  void *map = MAP_FAILED;
+  if (fstat(cfd, &cst) == 0 && cst.st_size >= (off_t)sizeof(struct cacheHeader))
+    map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+  close(cfd);
+  if (map == MAP_FAILED)
+    return 0;
+  const struct cacheHeader *h = map;
+  const struct cacheRow *cr = (const struct cacheRow *)(h + 1);
+  int ok = !memcmp(h->magic, KILO_CACHE_MAGIC, sizeof(h->magic)) &&
+           h->size == st.st_size && h->mtime_sec == st.st_mtim.tv_sec &&
+           h->mtime_nsec == st.st_mtim.tv_nsec &&
+           h->syntax == editorCacheSyntax() && h->nrows >= 0 &&
+           cst.st_size == (off_t)(sizeof(*h) + sizeof(*cr) * h->nrows);
+  if (ok) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    ok = fd != -1 && kiloSampleHash(fd, st.st_size) == h->sample;
+    if (fd != -1)
+      close(fd);
+  }
+  if (ok) {
+    E.row = calloc(h->nrows ? h->nrows : 1, sizeof(erow));
+    for (int j = 0; j < h->nrows; j++) {
+      erow *row = &E.row[j];
+      row->idx = j;
+      row->foff = cr[j].foff;
+      row->hash = cr[j].hash;
+      row->size = cr[j].size;
+      row->rsize = cr[j].rsize;
+      row->rwidth = cr[j].rwidth;
+      row->br_sum = cr[j].br_sum;
+      row->br_minpre = cr[j].br_minpre;
+      row->br_maxsuf = cr[j].br_maxsuf;
+      row->ascii = cr[j].ascii;
+      row->hl_open_comment = cr[j].hl_open_comment;
+      // charsはNULLのまま、追い出された行として始める。圧縮の対象にはならない
+      row->bidx = -1;
+    }
+    E.numrows = h->nrows;
+    E.tok_scan = 0;
+  }
+  munmap(map, cst.st_size);
+  return ok;
+}
+
+/*** file watch ***/
+// ファイルを置いたディレクトリごと監視する。
+// コード生成器は一時ファイルをrenameで置き換えることが多いため。
+void editorWatchFile() {
+  if (E.filename == NULL)
+    return;
+  if (E.watch_fd == -1) {
+    E.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.watch_fd == -1)
+      return;
+  }
+  if (E.watch_wd != -1)
+    inotify_rm_watch(E.watch_fd, E.watch_wd);
+  char *slash = strrchr(E.filename, '/');
+  char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+  E.watch_wd = inotify_add_watch(E.watch_fd, dir,
+                                 IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+  free(dir);
+}
+
+// たまっているイベントを読み、編集中のファイルに関するものがあれば1を返す
+int editorWatchDrain() {
+  if (E.watch_fd == -1 || E.watch_wd == -1 || E.filename == NULL)
+    return 0;
+  char *slash = strrchr(E.filename, '/');
+  char *base = slash ? slash + 1 : E.filename;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int hit = 0;
+  ssize_t len;
+  while ((len = read(E.watch_fd, buf, sizeof(buf))) > 0) {
+    char *p = buf;
+    while (p < buf + len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->wd == E.watch_wd && ev->len && !strcmp(ev->name, base))
+        hit = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  return hit;
+}
+
+// ディスク上の内容と比較し、変わった行の範囲だけをrow APIで反映する。
+// 変わっていない行はrender/hlをそのまま使い続ける。
+int editorReload() {
+  FILE *fp = fopen(E.filename, "r");
+  if (!fp)
+    return 0;
+  editorFoldClear();
+  E.mc_n = 0;
+  int cap = 0, nlines = 0;
+  char **lines = NULL;
+  int *lens = NULL;
+  uint64_t *hashes = NULL;
+  off_t *offs = NULL;
+  off_t off = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    off_t next = off + linelen;
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      linelen--;
+    if (nlines == cap) {
+      cap = cap ? cap * 2 : 256;
+      lines = realloc(lines, sizeof(char *) * cap);
+      lens = realloc(lens, sizeof(int) * cap);
+      hashes = realloc(hashes, sizeof(uint64_t) * cap);
+      offs = realloc(offs, sizeof(off_t) * cap);
+    }
+    offs[nlines] = off;
+    off = next;
+    lines[nlines] = malloc(linelen + 1);
+    memcpy(lines[nlines], line, linelen);
+    lens[nlines] = linelen;
+    hashes[nlines] = editorHashBytes(line, linelen);
+    nlines++;
+  }
+  free(line);
+  fclose(fp);
+
+  // 先頭と末尾の一致部分は差分計算から外す
+  int pre = 0;
+  while (pre < E.numrows && pre < nlines && E.row[pre].hash == hashes[pre])
+    pre++;
+  int suf = 0;
+  while (suf < E.numrows - pre && suf < nlines - pre &&
+         E.row[E.numrows - 1 - suf].hash == hashes[nlines - 1 - suf])
+    suf++;
+  int n = E.numrows - pre - suf;
+  int m = nlines - pre - suf;
+  uint64_t *old = malloc(sizeof(uint64_t) * (n + 1));
+  for (int j = 0; j < n; j++)
+    old[j] = E.row[pre + j].hash;
+  diffHunk *hunks;
+  int nhunks = diffHashes(old, n, &hashes[pre], m, KILO_DIFF_MAX_D, &hunks);
+  free(old);
+  if (nhunks < 0) {
+    hunks = malloc(sizeof(diffHunk));
+    hunks->a0 = 0;
+    hunks->a1 = n;
+    hunks->b0 = 0;
+    hunks->b1 = m;
+    nhunks = (n || m) ? 1 : 0;
+  }
+
+  // 後ろの区間から適用すれば前の区間の行番号はずれない
+  int changed = 0;
+  for (int h = nhunks - 1; h >= 0; h--) {
+    int a0 = pre + hunks[h].a0, a1 = pre + hunks[h].a1;
+    int b0 = pre + hunks[h].b0, b1 = pre + hunks[h].b1;
+    int common = (a1 - a0 < b1 - b0) ? a1 - a0 : b1 - b0;
+    int j;
+    for (j = 0; j < common; j++)
+      editorRowSetString(&E.row[a0 + j], lines[b0 + j], lens[b0 + j]);
+    for (j = a0 + common; j < a1; j++)
+      editorDelRow(a0 + common);
+    for (j = b0 + common; j < b1; j++)
+      editorInsertRow(a0 + (j - b0), lines[j], lens[j]);
+    changed += (a1 - a0 > b1 - b0) ? a1 - a0 : b1 - b0;
+  }
+  free(hunks);
+  // 行の位置は新しいファイルに合わせ直す
+  for (int j = 0; j < nlines; j++) {
+    E.row[j].foff = offs[j];
+    free(lines[j]);
+  }
+  free(lines);
+  free(lens);
+  free(hashes);
+  free(offs);
+  editorReopenFile();
+
+  E.dirty = 0;
+  E.lost = 0;
+  editorGutterReset();
+  editorCacheWrite();
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  if (E.cx > rowlen)
+    E.cx = rowlen;
+  if (E.rowoff > E.cy)
+    E.rowoff = E.cy;
+  editorSetStatusMessage("Reloaded from disk: %d lines changed", changed);
+  return 1;
+}
+
+// 監視イベントを確認し、必要なら再読み込みする。再描画が必要なら1を返す
+int editorCheckFileChange() {
+  if (E.prompting)
+    return 0;
+  // 読み戻せなかった行があれば、編集していない限りすぐ読み直す
+  if (!editorWatchDrain() && !(E.lost && !E.dirty))
+    return 0;
+  if (E.dirty) {
+    editorSetStatusMessage("File changed on disk (unsaved changes kept)");
+    return 1;
+  }
+  return editorReload();
+}
+
+/*** hex view ***/
+// 先頭にNULを含むファイルをバイナリとみなし、16進表示で開く。
+// 行には分けず、mmapした内容をオフセットで読む
+int editorHexOpen(const char *filename) {
+  int writable = 1;
+  int fd = open(filename, O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    writable = 0;
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+  }
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size == 0) {
+    if (fd != -1)
+      close(fd);
+    return 0;
+  }
+  char sniff[KILO_HEX_SNIFF];
+  ssize_t n = pread(fd, sniff, sizeof(sniff), 0);
+  if (n <= 0 || memchr(sniff, '\0', n) == NULL) {
+    close(fd);
+    return 0;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  // 先読みはせず、見ている範囲だけを読み込ませる
+  madvise(map, st.st_size, MADV_RANDOM);
+  struct hexView *h = calloc(1, sizeof(struct hexView));
+  h->fd = fd;
+  h->writable = writable;
+  h->map = map;
+  h->size = st.st_size;
+  E.hex = h;
+  E.syntax = NULL;
+  editorSetStatusMessage("Binary file: hex view%s", writable ? "" : " (read-only)");
+  return 1;
+}
+// patchの中でoff以上の最初の位置
+int editorHexPatchFind(off_t off) {
+  struct hexView *h = E.hex;
+  int lo = 0, hi = h->npatch;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (h->patch[mid].off < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+// offのバイト。書き換えてあればpatchedを1にする
+unsigned char editorHexByte(off_t off, int *patched) {
+  struct hexView *h = E.hex;
+  int j = h->npatch ? editorHexPatchFind(off) : 0;
+  *patched = j < h->npatch && h->patch[j].off == off;
+  return *patched ? h->patch[j].b : h->map[off];
+}
+void editorHexSet(off_t off, unsigned char b) {
+  struct hexView *h = E.hex;
+  int j = editorHexPatchFind(off);
+  if (j < h->npatch && h->patch[j].off == off) {
+    h->patch[j].b = b;
+  } else {
+    if (h->npatch == h->patch_cap) {
+      h->patch_cap = h->patch_cap ? h->patch_cap * 2 : 64;
+      h->patch = realloc(h->patch, sizeof(struct hexPatch) * h->patch_cap);
+    }
+    memmove(&h->patch[j + 1], &h->patch[j],
+            sizeof(struct hexPatch) * (h->npatch - j));
+    h->patch[j].off = off;
+    h->patch[j].b = b;
+    h->npatch++;
+  }
+  E.dirty++;
+}
+// 書き換えたバイトを連続する区間ごとにpwriteする。mmapはMAP_SHAREDなので
+// 書いた内容はそのまま表示に反映される
+void editorHexSave() {
+  struct hexView *h = E.hex;
+  if (!h->writable) {
+    editorSetStatusMessage("Can't save ! File is read-only");
+    return;
+  }
+  unsigned char buf[4096];
+  int written = 0;
+  for (int j = 0; j < h->npatch;) {
+    int n = 0;
+    while (j + n < h->npatch && n < (int)sizeof(buf) &&
+           h->patch[j + n].off == h->patch[j].off + n) {
+      buf[n] = h->patch[j + n].b;
+      n++;
+    }
+    if (pwrite(h->fd, buf, n, h->patch[j].off) != n) {
+      editorSetStatusMessage("Can't save ! I/O error: %s", strerror(errno));
+      return;
+    }
+    written += n;
+    j += n;
+  }
+  h->npatch = 0;
+  E.dirty = 0;
+  editorSetStatusMessage("%d bytes patched on disk", written);
+}
+// "de ad be ef"のような16進か、"..."で囲んだ文字列をバイト列にする
+int kiloParseBytes(const char *s, char *out) {
+  int n = 0;
+  if (*s == '"') {
+    for (s++; *s && *s != '"'; s++)
+      out[n++] = *s;
+    return n;
+  }
+  while (*s) {
+    if (isspace((unsigned char)*s)) {
+      s++;
+      continue;
+    }
+    if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]))
+      return -1;
+    char hex[3] = {s[0], s[1], 0};
+    out[n++] = strtol(hex, NULL, 16);
+    s += 2;
+  }
+  return n;
+}
+// カーソルの次からバイト列を探し、末尾まで来たら先頭に戻る。
+// 走査はKILO_HEX_SCANずつで、読み終わったページは手放す。
+// 保存していない書き換えは検索に含めない
+void editorHexFind() {
+  struct hexView *h = E.hex;
+  char *query =
+      editorPrompt("Find bytes: %s (hex like de ad, or \"text\")", NULL);
+  if (query == NULL)
+    return;
+  char *needle = malloc(strlen(query) + 1);
+  int m = kiloParseBytes(query, needle);
+  free(query);
+  if (m <= 0) {
+    editorSetStatusMessage("Bad byte pattern");
+    free(needle);
+    return;
+  }
+  long pagesz = sysconf(_SC_PAGESIZE);
+  off_t start = h->cur + 1;
+  off_t found = -1;
+  for (int pass = 0; pass < 2 && found < 0; pass++) {
+    off_t from = pass ? 0 : start;
+    off_t to = pass ? start + m - 1 : h->size;
+    if (to > h->size)
+      to = h->size;
+    while (from + m <= to && found < 0) {
+      off_t len = to - from < KILO_HEX_SCAN ? to - from : KILO_HEX_SCAN;
+      if (len < m)
+        break;
+      const char *hay = (const char *)h->map + from;
+      const char *p = kiloMemmem(hay, len, needle, m);
+      if (p)
+        found = from + (p - hay);
+      off_t lo = from & ~(off_t)(pagesz - 1);
+      madvise(h->map + lo, from + len - lo, MADV_DONTNEED);
+      // 区切りをまたぐ一致を逃さないよう少し重ねる
+      from += len - m + 1;
+    }
+  }
+  free(needle);
+  if (found < 0) {
+    editorSetStatusMessage("Not found");
+    return;
+  }
+  h->cur = found;
+  h->nib = 0;
+  editorSetStatusMessage("Found at 0x%llx", (unsigned long long)found);
+}
+void editorHexGoto() {
+  struct hexView *h = E.hex;
+  char *query = editorPrompt("Go to offset: %s (0x for hex)", NULL);
+  if (query == NULL)
+    return;
+  unsigned long long off = strtoull(query, NULL, 0);
+  free(query);
+  h->cur = off < (unsigned long long)h->size ? (off_t)off : h->size - 1;
+  h->nib = 0;
+}
+void editorHexScroll() {
+  struct hexView *h = E.hex;
+  off_t row = h->cur - h->cur % KILO_HEX_COLS;
+  off_t span = (off_t)KILO_HEX_COLS * E.screenrows;
+  if (row < h->top)
+    h->top = row;
+  if (row >= h->top + span)
+    h->top = row - span + KILO_HEX_COLS;
+}
+// 16進表示のときのキー処理。テキストの編集につながるキーはここで止める。
+// 通常の処理に回すキーなら0を返す
+int editorHexKey(int c) {
+  struct hexView *h = E.hex;
+  off_t page = (off_t)KILO_HEX_COLS * E.screenrows;
+  off_t cur = h->cur;
+  switch (c) {
+  case CTRL_KEY('q'):
+  case CTRL_KEY('s'):
+  case CTRL_KEY('o'):
+  case CTRL_KEY('x'):
+  case CTRL_KEY('r'):
+  case CTRL_KEY('l'):
+  case CTRL_KEY('t'):
+    return 0;
+  case CTRL_KEY('f'):
+    editorHexFind();
+    return 1;
+  case CTRL_KEY('g'):
+    editorHexGoto();
+    return 1;
+  case ARROW_LEFT:
+    cur--;
+    break;
+  case ARROW_RIGHT:
+    cur++;
+    break;
+  case ARROW_UP:
+    cur -= KILO_HEX_COLS;
+    break;
+  case ARROW_DOWN:
+    cur += KILO_HEX_COLS;
+    break;
+  case PAGE_UP:
+    cur -= page;
+    h->top -= page;
+    break;
+  case PAGE_DOWN:
+    cur += page;
+    h->top += page;
+    break;
+  case HOME_KEY:
+    cur -= cur % KILO_HEX_COLS;
+    break;
+  case END_KEY:
+    cur += KILO_HEX_COLS - 1 - cur % KILO_HEX_COLS;
+    break;
+  default:
+    // 16進の数字でカーソルの上位・下位の4bitを書き換える
+    if (c < 128 && isxdigit(c)) {
+      if (!h->writable) {
+        editorSetStatusMessage("File is read-only");
+        return 1;
+      }
+      int patched;
+      int d = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+      unsigned char b = editorHexByte(h->cur, &patched);
+      b = h->nib ? (b & 0xf0) | d : (b & 0x0f) | d << 4;
+      editorHexSet(h->cur, b);
+      if (h->nib && h->cur < h->size - 1)
+        h->cur++;
+      h->nib = !h->nib;
+    }
+    return 1;
+  }
+  if (cur < 0)
+    cur = 0;
+  if (cur >= h->size)
+    cur = h->size - 1;
+  if (h->top < 0)
+    h->top = 0;
+  if (h->top > cur - cur % KILO_HEX_COLS)
+    h->top = cur - cur % KILO_HEX_COLS;
+  h->cur = cur;
+  h->nib = 0;
+  return 1;
+}
+
+// file io
+char *ediotrRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    totlen += E.row[j].size + 1;
+  }
+  *buflen = totlen;
+  char *buf = malloc(totlen);
+  char *p = buf;
+  for (j = 0; j < E.numrows; j++) {
+    // 圧縮・追い出しされた行は展開せずに中身だけ読む
+    memcpy(p, editorRowPeek(&E.row[j]), E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+  return buf;
+}
+
+void editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = strdup(filename);
+
   editorSelectSyntaxHighlight();
+  if (editorHexOpen(filename))
+    return;
+  // 索引のキャッシュがあれば行の中身は読まない
+  if (editorCacheLoad(filename)) {
+    editorGutterReset();
+    editorReopenFile();
+    editorWatchFile();
+    return;
+  }
   FILE *fp = fopen(filename, "r");
   if (!fp)
     die("fopen");
@@ -593,114 +3561,1532 @@ void editorOpen(char *filename) {
   // lineの長さを保持するための変数
   size_t linecap = 0;
   ssize_t linelen;
+  off_t off = 0;
   while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    off_t foff = off;
+    off += linelen;
     while (linelen > 0 &&
            // 改行の部分を覗いた長さを求めてる
            (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
       linelen--;
     }
-    editorInsertRow(E.numrows, line, linelen);
-    E.dirty = 0;
+    editorInsertRow(E.numrows, line, linelen);
+    // 読み込んだだけの行は最近触った行とはみなさない
+    E.row[E.numrows - 1].touched = 0;
+    E.row[E.numrows - 1].foff = foff;
+    if (E.numrows % 1024 == 0)
+      editorEnforceBudget();
+    E.dirty = 0;
+  }
+  free(line);
+  fclose(fp);
+  // 補完用の並べ替えは読み込み時に済ませておく
+  editorTokenMerge();
+  editorGutterReset();
+  editorReopenFile();
+  editorCacheWrite();
+  editorWatchFile();
+}
+// grepの結果バッファは書き換えも保存もさせない。そうなら1を返す
+int editorReadOnly() {
+  if (!E.grep_results)
+    return 0;
+  editorSetStatusMessage("%s is read-only", E.filename);
+  return 1;
+}
+void editorSave() {
+  if (editorReadOnly())
+    return;
+  if (E.hex) {
+    editorHexSave();
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as : %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+  char *filepath = E.filename;
+  if (filepath == NULL)
+    return;
+  int len;
+  char *buf = ediotrRowsToString(&len);
+  // 読み戻せなかった行を空白のまま書き出さない
+  if (E.lost) {
+    free(buf);
+    editorSetStatusMessage("Can't save: %d lines were lost when the file "
+                           "changed on disk",
+                           E.lost);
+    return;
+  }
+  int fd = open(filepath, O_RDWR | O_CREAT, 0644);
+  if (fd != -1) {
+    if (truncate(filepath, len) != -1) {
+      if (write(fd, buf, len) == len) {
+        free(buf);
+        close(fd);
+        E.dirty = 0;
+        // 書き出した内容に合わせて行の位置を振り直す
+        off_t off = 0;
+        for (int j = 0; j < E.numrows; j++) {
+          E.row[j].foff = off;
+          off += E.row[j].size + 1;
+        }
+        editorGutterReset();
+        editorReopenFile();
+        editorCacheWrite();
+        // 自分で書いた分のイベントは捨てる
+        editorWatchFile();
+        editorWatchDrain();
+        editorSetStatusMessage("%d bytes written to disk", len);
+        return;
+      }
+    }
+    close(fd);
+  }
+  editorSetStatusMessage("Can't save ! I/O error: %s", strerror(errno));
+  free(buf);
+}
+
+/*** stream ***/
+// kilo - で標準入力を読む。パイプは入力待ちの間に少しずつ読んで行を末尾に
+// 足していくので、書き手が終わる前から表示・移動できる。
+
+// 標準入力をパイプとして取っておき、キー入力用に制御端末を開き直す。
+// 標準入力が端末なら読むものはないので-1を返す
+int kiloStdinToTty() {
+  if (isatty(STDIN_FILENO))
+    return -1;
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+  if (fd == -1 || tty == -1)
+    die("open /dev/tty");
+  dup2(tty, STDIN_FILENO);
+  close(tty);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+void editorStreamOpen(int fd) {
+  E.stream_fd = fd;
+  E.stream_plen = 0;
+  editorSetStatusMessage("Reading from stdin...");
+}
+// 1行を末尾に足す。ファイルに裏付けのない行なので追い出されることはない
+void editorStreamLine(const char *s, int len) {
+  if (len > 0 && s[len - 1] == '\r')
+    len--;
+  editorInsertRow(E.numrows, (char *)s, len);
+  E.row[E.numrows - 1].touched = 0;
+  if (E.numrows % 1024 == 0)
+    editorEnforceBudget();
+}
+// 行[from,numrows)は読み込んだだけの行なので保存版に加える
+void editorStreamBase(int from) {
+  int n = E.numrows - from;
+  E.base = realloc(E.base, sizeof(uint64_t) * (E.base_n + n + 1));
+  for (int j = from; j < E.numrows; j++) {
+    E.base[E.base_n] = E.row[j].hash;
+    E.row[j].bidx = E.base_n++;
+  }
+}
+// まだ改行の来ていない行の続きをためる
+void editorStreamKeep(const char *s, int len) {
+  E.stream_part = realloc(E.stream_part, E.stream_plen + len + 1);
+  memcpy(E.stream_part + E.stream_plen, s, len);
+  E.stream_plen += len;
+}
+// 入力待ちの間に呼ばれる。deadlineまでパイプを読み、来ている分を行にする。
+// 何も来ていなければ0を返す
+int editorStreamRead(long long deadline) {
+  static char *buf = NULL;
+  if (E.stream_fd == -1)
+    return 0;
+  if (buf == NULL)
+    buf = malloc(KILO_STREAM_CHUNK);
+  int dirty = E.dirty;
+  int gut_lo = E.gut_lo;
+  int before = E.numrows;
+  int eof = 0;
+  ssize_t n = 0;
+  while (kiloNowUs() < deadline) {
+    n = read(E.stream_fd, buf, KILO_STREAM_CHUNK);
+    if (n <= 0) {
+      eof = n == 0 || (errno != EAGAIN && errno != EINTR);
+      break;
+    }
+    const char *p = buf, *end = buf + n, *nl;
+    while ((nl = kiloFindNewline(p, end - p)) != NULL) {
+      if (E.stream_plen) {
+        editorStreamKeep(p, nl - p);
+        editorStreamLine(E.stream_part, E.stream_plen);
+        E.stream_plen = 0;
+      } else {
+        editorStreamLine(p, nl - p);
+      }
+      p = nl + 1;
+    }
+    editorStreamKeep(p, end - p);
+  }
+  if (eof && E.stream_plen)
+    editorStreamLine(E.stream_part, E.stream_plen);
+  editorStreamBase(before);
+  if (eof) {
+    free(E.stream_part);
+    E.stream_part = NULL;
+    E.stream_plen = 0;
+    close(E.stream_fd);
+    E.stream_fd = -1;
+    editorSetStatusMessage("Read %d lines from stdin", E.numrows);
+  }
+  // 読み込んだ分は編集ではない
+  E.dirty = dirty;
+  if (gut_lo < 0 && E.gut_tail == GUT_NONE)
+    E.gut_lo = -1;
+  return eof || E.numrows > before || n > 0;
+}
+
+/*** buffers ***/
+// 表示中のバッファの状態をbに退避する
+void editorBufferStore(struct editorBuffer *b) {
+  // 後回しにしたハイライトはこのバッファの行にしか付けられない
+  editorSyntaxFlush();
+  // 複数カーソルはバッファを切り替えると解除する
+  E.mc_n = 0;
+  b->cx = E.cx;
+  b->cy = E.cy;
+  b->rx = E.rx;
+  b->rowoff = E.rowoff;
+  b->coloff = E.coloff;
+  b->numrows = E.numrows;
+  b->dirty = E.dirty;
+  b->filename = E.filename;
+  b->row = E.row;
+  b->syntax = E.syntax;
+  b->fd = E.fd;
+  b->lost = E.lost;
+  b->watch_fd = E.watch_fd;
+  b->watch_wd = E.watch_wd;
+  b->softwrap = E.softwrap;
+  b->voff = E.voff;
+  b->wrap = E.wrap;
+  b->nfolds = E.nfolds;
+  b->sweep = E.sweep;
+  b->sweep_dry = E.sweep_dry;
+  b->sweep_tick = E.sweep_tick;
+  b->bt = E.bt;
+  b->tok = E.tok;
+  b->tok_cap = E.tok_cap;
+  b->tok_n = E.tok_n;
+  b->tok_keys = E.tok_keys;
+  b->tok_sorted = E.tok_sorted;
+  b->tok_nsorted = E.tok_nsorted;
+  b->tok_merge = E.tok_merge;
+  b->tok_scan = E.tok_scan;
+  b->grep_results = E.grep_results;
+  b->base = E.base;
+  b->base_n = E.base_n;
+  b->gut_lo = E.gut_lo;
+  b->gut_hi = E.gut_hi;
+  b->gut_tail = E.gut_tail;
+  b->stream_fd = E.stream_fd;
+  b->stream_part = E.stream_part;
+  b->stream_plen = E.stream_plen;
+  b->hex = E.hex;
+  b->last_used = E.tick;
+  b->evicted = 0;
+}
+// bの状態を表示中のバッファにする
+void editorBufferLoad(struct editorBuffer *b) {
+  E.cx = b->cx;
+  E.cy = b->cy;
+  E.rx = b->rx;
+  E.rowoff = b->rowoff;
+  E.coloff = b->coloff;
+  E.numrows = b->numrows;
+  E.dirty = b->dirty;
+  E.filename = b->filename;
+  E.row = b->row;
+  E.syntax = b->syntax;
+  E.fd = b->fd;
+  E.lost = b->lost;
+  E.watch_fd = b->watch_fd;
+  E.watch_wd = b->watch_wd;
+  E.softwrap = b->softwrap;
+  E.voff = b->voff;
+  E.wrap = b->wrap;
+  E.nfolds = b->nfolds;
+  E.sweep = b->sweep;
+  E.sweep_dry = b->sweep_dry;
+  E.sweep_tick = b->sweep_tick;
+  E.bt = b->bt;
+  E.tok = b->tok;
+  E.tok_cap = b->tok_cap;
+  E.tok_n = b->tok_n;
+  E.tok_keys = b->tok_keys;
+  E.tok_sorted = b->tok_sorted;
+  E.tok_nsorted = b->tok_nsorted;
+  E.tok_merge = b->tok_merge;
+  E.tok_scan = b->tok_scan;
+  E.grep_results = b->grep_results;
+  E.base = b->base;
+  E.base_n = b->base_n;
+  E.gut_lo = b->gut_lo;
+  E.gut_hi = b->gut_hi;
+  E.gut_tail = b->gut_tail;
+  E.stream_fd = b->stream_fd;
+  E.stream_part = b->stream_part;
+  E.stream_plen = b->stream_plen;
+  E.hex = b->hex;
+}
+// 表示中のバッファを空にする
+void editorBufferReset() {
+  E.cx = 0;
+  E.cy = 0;
+  E.rx = 0;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.numrows = 0;
+  E.dirty = 0;
+  E.row = NULL;
+  E.filename = NULL;
+  E.syntax = NULL;
+  E.fd = -1;
+  E.lost = 0;
+  E.watch_fd = -1;
+  E.watch_wd = -1;
+  E.softwrap = 0;
+  E.voff = 0;
+  E.wrap = NULL;
+  E.nfolds = 0;
+  E.sweep = 0;
+  E.sweep_dry = 0;
+  E.sweep_tick = 0;
+  E.bt = NULL;
+  E.tok = NULL;
+  E.tok_cap = 0;
+  E.tok_n = 0;
+  E.tok_keys = NULL;
+  E.tok_sorted = NULL;
+  E.tok_nsorted = 0;
+  memset(&E.tok_merge, 0, sizeof(E.tok_merge));
+  E.tok_scan = -1;
+  E.grep_results = 0;
+  E.base = NULL;
+  E.base_n = 0;
+  E.gut_lo = -1;
+  E.gut_hi = -1;
+  E.gut_tail = GUT_NONE;
+  E.stream_fd = -1;
+  E.stream_part = NULL;
+  E.stream_plen = 0;
+  E.hex = NULL;
+}
+// 空のバッファを作って表示する
+void editorNewBuffer() {
+  editorBufferStore(&E.bufs[E.curbuf]);
+  E.bufs = realloc(E.bufs, sizeof(struct editorBuffer) * (E.nbufs + 1));
+  E.curbuf = E.nbufs++;
+  editorBufferReset();
+}
+void editorSwitchBuffer(int n) {
+  if (n == E.curbuf)
+    return;
+  editorBufferStore(&E.bufs[E.curbuf]);
+  E.curbuf = n;
+  editorBufferLoad(&E.bufs[n]);
+  // 裏にいた間の外部変更を反映する。追い出された行は描画するときに作り直される
+  editorCheckFileChange();
+  editorSetStatusMessage("Buffer %d/%d: %s", n + 1, E.nbufs,
+                         E.filename ? E.filename : "[No Name]");
+}
+void editorOpenBuffer() {
+  char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (filename == NULL)
+    return;
+  if (access(filename, R_OK) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    free(filename);
+    return;
+  }
+  // 名前のない空のバッファならそこに開く
+  if (E.filename || E.numrows || E.dirty)
+    editorNewBuffer();
+  editorOpen(filename);
+  free(filename);
+}
+int editorAnyDirty() {
+  if (E.dirty)
+    return 1;
+  for (int j = 0; j < E.nbufs; j++) {
+    if (j != E.curbuf && E.bufs[j].dirty)
+      return 1;
+  }
+  return 0;
+}
+
+// 裏のバッファの行からrender/hlを捨てる。保存済みならcharsも捨てて、
+// 次に表示されたときにファイルから読み戻す
+void editorEvictBuffer(struct editorBuffer *b) {
+  int drop = !b->dirty && b->fd != -1;
+  for (int j = 0; j < b->numrows; j++) {
+    erow *row = &b->row[j];
+    if (row->cold)
+      continue;
+    free(row->render);
+    free(row->hl);
+    free(row->br);
+    row->render = NULL;
+    row->hl = NULL;
+    row->br = NULL;
+    row->nbr = 0;
+    if (drop && row->foff >= 0) {
+      free(row->chars);
+      row->chars = NULL;
+    }
+    editorRowAccount(row);
   }
-  free(line);
-  fclose(fp);
+  b->evicted = 1;
 }
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as : %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
+// 予算に収まるまで、長く表示されていないバッファから順に追い出す
+void editorEvictBackground() {
+  while (E.mem_used > E.mem_budget) {
+    struct editorBuffer *lru = NULL;
+    for (int j = 0; j < E.nbufs; j++) {
+      struct editorBuffer *b = &E.bufs[j];
+      if (j != E.curbuf && !b->evicted &&
+          (lru == NULL || b->last_used < lru->last_used))
+        lru = b;
+    }
+    if (lru == NULL)
       return;
+    editorEvictBuffer(lru);
+  }
+}
+
+/*** grep ***/
+// 検索スレッドと画面側で共有するgrepの状態。すべてlockで守る
+struct grepJob {
+  char *pattern;
+  size_t plen;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // 走査待ちのファイル。walkerが積み、workerがnextから順に取っていく
+  char **paths;
+  int npaths;
+  int paths_cap;
+  int next;
+  int walk_done;
+  int cancel;
+  // まだ動いているworkerの数
+  int active;
+  // 結果バッファにまだ移していない行
+  char **results;
+  int nresults;
+  int results_cap;
+  long files;
+  long matches;
+  long long bytes;
+  pthread_t walker;
+  int walking;
+  pthread_t workers[KILO_GREP_THREADS];
+  int nworkers;
+  struct timespec start;
+};
+
+int grepCancelled(struct grepJob *g) {
+  pthread_mutex_lock(&g->lock);
+  int cancel = g->cancel;
+  pthread_mutex_unlock(&g->lock);
+  return cancel;
+}
+void grepPushPath(struct grepJob *g, char *path) {
+  pthread_mutex_lock(&g->lock);
+  if (g->npaths == g->paths_cap) {
+    g->paths_cap = g->paths_cap ? g->paths_cap * 2 : 256;
+    g->paths = realloc(g->paths, sizeof(char *) * g->paths_cap);
+  }
+  g->paths[g->npaths++] = path;
+  pthread_cond_signal(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+}
+// dir以下の通常ファイルを積む。隠しファイルと隠しディレクトリ(.gitなど)は飛ばす
+void grepWalk(struct grepJob *g, const char *dir) {
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL && !grepCancelled(g)) {
+    if (de->d_name[0] == '.')
+      continue;
+    char *path;
+    if (strcmp(dir, ".") == 0) {
+      path = strdup(de->d_name);
+    } else {
+      size_t len = strlen(dir) + strlen(de->d_name) + 2;
+      path = malloc(len);
+      snprintf(path, len, "%s/%s", dir, de->d_name);
+    }
+    int type = de->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat(path, &st) == 0)
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+    }
+    if (type == DT_DIR) {
+      grepWalk(g, path);
+      free(path);
+    } else if (type == DT_REG) {
+      grepPushPath(g, path);
+    } else {
+      free(path);
     }
-    editorSelectSyntaxHighlight();
   }
-  char *filepath = E.filename;
-  if (filepath == NULL)
+  closedir(d);
+}
+void *grepWalker(void *arg) {
+  struct grepJob *g = arg;
+  grepWalk(g, ".");
+  pthread_mutex_lock(&g->lock);
+  g->walk_done = 1;
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+// ファイルをmmapしてコピーせずに走査し、一致した行を"path:行番号:本文"にする
+void grepFile(struct grepJob *g, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
     return;
-  int len;
-  char *buf = ediotrRowsToString(&len);
-  int fd = open(filepath, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (truncate(filepath, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        free(buf);
-        close(fd);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  size_t size = st.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+  madvise(map, size, MADV_SEQUENTIAL);
+  char **found = NULL;
+  int nfound = 0;
+  int cap = 0;
+  // 先頭4KBにNULがあればバイナリとみなして飛ばす
+  if (memchr(map, '\0', size < 4096 ? size : 4096) == NULL) {
+    const char *end = map + size;
+    const char *p = map;
+    const char *counted = map;
+    long lineno = 1;
+    while (p < end &&
+           (p = kiloMemmem(p, end - p, g->pattern, g->plen)) != NULL) {
+      const char *nl = memrchr(map, '\n', p - map);
+      const char *ls = nl ? nl + 1 : map;
+      const char *le = memchr(p, '\n', end - p);
+      if (le == NULL)
+        le = end;
+      lineno += kiloCountNewlines(counted, ls - counted);
+      counted = ls;
+      int tlen = le - ls;
+      if (tlen > 0 && ls[tlen - 1] == '\r')
+        tlen--;
+      if (tlen > KILO_GREP_LINE_MAX)
+        tlen = KILO_GREP_LINE_MAX;
+      int n = snprintf(NULL, 0, "%s:%ld:", path, lineno);
+      char *line = malloc(n + tlen + 1);
+      snprintf(line, n + 1, "%s:%ld:", path, lineno);
+      memcpy(line + n, ls, tlen);
+      line[n + tlen] = '\0';
+      if (nfound == cap) {
+        cap = cap ? cap * 2 : 16;
+        found = realloc(found, sizeof(char *) * cap);
+      }
+      found[nfound++] = line;
+      // 1行につき1件
+      p = le < end ? le + 1 : end;
+    }
+  }
+  munmap(map, size);
+
+  pthread_mutex_lock(&g->lock);
+  g->files++;
+  g->bytes += size;
+  g->matches += nfound;
+  if (g->nresults + nfound > g->results_cap) {
+    while (g->nresults + nfound > g->results_cap)
+      g->results_cap = g->results_cap ? g->results_cap * 2 : 256;
+    g->results = realloc(g->results, sizeof(char *) * g->results_cap);
+  }
+  memcpy(&g->results[g->nresults], found, sizeof(char *) * nfound);
+  g->nresults += nfound;
+  pthread_mutex_unlock(&g->lock);
+  free(found);
+}
+void *grepWorker(void *arg) {
+  struct grepJob *g = arg;
+  pthread_mutex_lock(&g->lock);
+  for (;;) {
+    while (g->next == g->npaths && !g->walk_done && !g->cancel)
+      pthread_cond_wait(&g->cond, &g->lock);
+    if (g->cancel || g->next == g->npaths)
+      break;
+    char *path = g->paths[g->next++];
+    pthread_mutex_unlock(&g->lock);
+    grepFile(g, path);
+    free(path);
+    pthread_mutex_lock(&g->lock);
+  }
+  g->active--;
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+// 実行中のgrepを(cancelなら打ち切って)終わらせて片付ける
+void editorGrepFinish(int cancel) {
+  struct grepJob *g = E.grep;
+  if (g == NULL)
+    return;
+  if (cancel) {
+    pthread_mutex_lock(&g->lock);
+    g->cancel = 1;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+  }
+  if (g->walking)
+    pthread_join(g->walker, NULL);
+  for (int j = 0; j < g->nworkers; j++)
+    pthread_join(g->workers[j], NULL);
+  for (int j = g->next; j < g->npaths; j++)
+    free(g->paths[j]);
+  for (int j = 0; j < g->nresults; j++)
+    free(g->results[j]);
+  free(g->paths);
+  free(g->results);
+  free(g->pattern);
+  pthread_mutex_destroy(&g->lock);
+  pthread_cond_destroy(&g->cond);
+  free(g);
+  E.grep = NULL;
+}
+// 溜まった結果を結果バッファの末尾に移す。表示中でなければ表示されるまで溜めておく
+int editorGrepPoll() {
+  struct grepJob *g = E.grep;
+  if (g == NULL || !E.grep_results || E.prompting)
+    return 0;
+  pthread_mutex_lock(&g->lock);
+  char **results = g->results;
+  int n = g->nresults;
+  g->results = NULL;
+  g->nresults = 0;
+  g->results_cap = 0;
+  int done = g->walk_done && g->active == 0;
+  long files = g->files;
+  long matches = g->matches;
+  long long bytes = g->bytes;
+  pthread_mutex_unlock(&g->lock);
+
+  for (int j = 0; j < n; j++) {
+    editorInsertRow(E.numrows, results[j], strlen(results[j]));
+    free(results[j]);
+  }
+  free(results);
+  E.dirty = 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double secs = (now.tv_sec - g->start.tv_sec) +
+                (now.tv_nsec - g->start.tv_nsec) / 1e9;
+  if (done) {
+    editorGrepFinish(0);
+    editorSetStatusMessage("grep: %ld matches in %ld files (%.1f MB, %.2fs)",
+                           matches, files, bytes / 1048576.0, secs);
+  } else {
+    editorSetStatusMessage("grep: %ld matches in %ld files so far...",
+                           matches, files);
+  }
+  return n > 0 || done;
+}
+// カレントディレクトリ以下を並列に検索し、結果を*grep*バッファに流し込む
+void editorGrep() {
+  char *pattern = editorPrompt("Grep: %s (ESC to cancel)", NULL);
+  if (pattern == NULL)
+    return;
+  if (pattern[0] == '\0') {
+    free(pattern);
+    return;
+  }
+  editorGrepFinish(1);
+
+  int found = -1;
+  for (int j = 0; j < E.nbufs; j++) {
+    if (j == E.curbuf ? E.grep_results : E.bufs[j].grep_results)
+      found = j;
+  }
+  if (found == -1) {
+    if (E.filename || E.numrows || E.dirty)
+      editorNewBuffer();
+    E.filename = strdup("*grep*");
+    E.grep_results = 1;
+  } else {
+    editorSwitchBuffer(found);
+  }
+  editorFoldClear();
+  while (E.numrows > 0)
+    editorDelRow(E.numrows - 1);
+  E.cx = 0;
+  E.cy = 0;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.voff = 0;
+  E.dirty = 0;
+
+  struct grepJob *g = calloc(1, sizeof(struct grepJob));
+  g->pattern = pattern;
+  g->plen = strlen(pattern);
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->cond, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &g->start);
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  g->nworkers = ncpu < 1 ? 1 : ncpu > KILO_GREP_THREADS ? KILO_GREP_THREADS : ncpu;
+  g->active = g->nworkers;
+  // 作れなかったworkerの分は減らし、1つも作れなければ打ち切る
+  int started = 0;
+  int err = 0;
+  while (started < g->nworkers &&
+         (err = pthread_create(&g->workers[started], NULL, grepWorker, g)) ==
+             0)
+    started++;
+  pthread_mutex_lock(&g->lock);
+  g->active -= g->nworkers - started;
+  pthread_mutex_unlock(&g->lock);
+  g->nworkers = started;
+  E.grep = g;
+  if (started > 0)
+    err = pthread_create(&g->walker, NULL, grepWalker, g);
+  if (started == 0 || err != 0) {
+    editorGrepFinish(1);
+    editorSetStatusMessage("grep: can't start threads: %s", strerror(err));
+    return;
+  }
+  g->walking = 1;
+  editorSetStatusMessage("grep: searching for \"%s\"...", pattern);
+}
+// 結果の行"path:行番号:本文"が指す場所を開く
+void editorGrepJump() {
+  if (E.cy >= E.numrows)
+    return;
+  erow *row = editorRowAt(E.cy);
+  char *path = NULL;
+  long line = 0;
+  // パスに':'が含まれていてもいいように、数字だけを挟む':'を探す
+  for (char *p = strchr(row->chars, ':'); p; p = strchr(p + 1, ':')) {
+    char *q = p + 1;
+    while (isdigit((unsigned char)*q))
+      q++;
+    if (q > p + 1 && *q == ':') {
+      path = strndup(row->chars, p - row->chars);
+      line = atol(p + 1);
+      break;
+    }
+  }
+  if (path == NULL)
+    return;
+  if (access(path, R_OK) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", path, strerror(errno));
+    free(path);
+    return;
+  }
+  int found = -1;
+  for (int j = 0; j < E.nbufs; j++) {
+    char *name = j == E.curbuf ? E.filename : E.bufs[j].filename;
+    if (name && strcmp(name, path) == 0)
+      found = j;
+  }
+  if (found != -1) {
+    editorSwitchBuffer(found);
+  } else {
+    editorNewBuffer();
+    editorOpen(path);
+  }
+  free(path);
+  E.cy = line - 1;
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  if (E.cy < 0)
+    E.cy = 0;
+  E.cx = 0;
+}
+
+void editorFindCallback(char *query, int key) {
+  static int last_match = -1;
+  static int direction = 1;
+
+  static int saved_hl_line;
+  static char *saved_hl = NULL;
+  static char *peek = NULL;
+  static int peek_cap = 0;
+
+  if (saved_hl) {
+    erow *row = editorRowAt(saved_hl_line);
+    memcpy(row->hl, saved_hl, row->rsize);
+    free(saved_hl);
+    saved_hl = NULL;
+  }
+  if (key == '\r' || key == '\x1b') {
+    last_match = -1;
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    last_match = -1;
+    direction = 1;
+  }
+  if (last_match == -1)
+    direction = 1;
+  int current = last_match;
+  int i;
+  for (i = 0; i < E.numrows; i++) {
+    current += direction;
+    if (current == -1)
+      current = E.numrows - 1;
+    else if (current == E.numrows)
+      current = 0;
+    erow *row = &E.row[current];
+    // 圧縮・追い出しされた行は一致したときだけ作り直す。展開済みの行と同じく
+    // タブを展開した内容で比べ、行にNULがあっても探せるよう長さで比べる
+    if (row->chars == NULL) {
+      char *line = editorRowPeek(row);
+      int tabs;
+      int ascii = kiloScanAscii(line, row->size, &tabs);
+      int need = row->size + tabs * (KILO_TAB_STOP - 1) + 1;
+      if (need > peek_cap) {
+        peek = realloc(peek, need);
+        peek_cap = need;
+      }
+      int cols;
+      int len = kiloExpandTabs(line, row->size, ascii, peek, &cols);
+      if (!kiloMemmem(peek, len, query, strlen(query)))
+        continue;
+    }
+    row = editorRowAt(current);
+    const char *match =
+        kiloMemmem(row->render, row->rsize, query, strlen(query));
+    if (match) {
+      last_match = current;
+      E.cy = current;
+      E.cx = editorRowRxToCx(row, editorRenderCol(row, match - row->render));
+      E.rowoff = E.numrows;
+      saved_hl_line = current;
+      saved_hl = malloc(row->rsize);
+      memcpy(saved_hl, row->hl, row->rsize);
+      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+      break;
+    }
+  }
+}
+void editorFind() {
+  int save_cx = E.cx;
+  int save_cy = E.cy;
+  int save_coloff = E.coloff;
+  int save_rowoff = E.rowoff;
+  int save_voff = E.voff;
+  char *query =
+      editorPrompt("Search:%s (USE/ESC/Arrows/Enter)", editorFindCallback);
+  if (query) {
+    free(query);
+  } else {
+    E.cx = save_cx;
+    E.cy = save_cy;
+    E.coloff = save_coloff;
+    E.rowoff = save_rowoff;
+    E.voff = save_voff;
+  }
+}
+// 指定した行に移動する。折り返し表示ではその行を画面の先頭にする
+void editorGotoLine() {
+  char *query = editorPrompt("Go to line: %s (ESC to cancel)", NULL);
+  if (query == NULL)
+    return;
+  int line = atoi(query);
+  free(query);
+  if (line < 1)
+    line = 1;
+  if (line > E.numrows)
+    line = E.numrows;
+  E.cy = line > 0 ? line - 1 : 0;
+  E.cx = 0;
+  if (editorVisualMap())
+    E.voff = editorWrapPrefix(E.cy);
+  else
+    E.rowoff = E.cy;
+}
+// カーソルの前の単語をバッファ内の単語で補完する。続けて押すと次の候補になる
+void editorComplete() {
+  static unsigned int last_tick = 0;
+  static char *cands[KILO_COMPLETE_MAX];
+  static int ncands = 0;
+  static int cur = 0;
+  static int plen = 0;
+  if (E.cy >= E.numrows)
+    return;
+  if (ncands > 0 && E.tick == last_tick + 1) {
+    // 直前に入れた候補を消して次の候補にする
+    for (int j = strlen(cands[cur]) - plen; j > 0; j--)
+      editorDelChar();
+    cur = (cur + 1) % ncands;
+  } else {
+    // 単語はハイライトするときに数えるので、後回しの分を先に済ませる
+    editorSyntaxFlush();
+    erow *row = editorRowAt(E.cy);
+    int start = E.cx;
+    while (start > 0 && is_ident_char(row->chars[start - 1]))
+      start--;
+    plen = E.cx - start;
+    ncands = 0;
+    if (plen == 0) {
+      editorSetStatusMessage("Nothing to complete");
+      return;
+    }
+    char *prefix = strndup(&row->chars[start], plen);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ncands = editorTokenComplete(prefix, plen, cands, KILO_COMPLETE_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(prefix);
+    cur = 0;
+    // キャッシュから開いた直後で数え終わっていない行があればそう出す
+    char note[32] = "";
+    if (E.tok_scan >= 0)
+      snprintf(note, sizeof(note), ", index %d%% built",
+               (int)(100LL * E.tok_scan / E.numrows));
+    if (ncands == 0) {
+      if (note[0])
+        editorSetStatusMessage("No completions (%s)", note + 2);
+      else
+        editorSetStatusMessage("No completions");
+      return;
+    }
+    editorSetStatusMessage(
+        "%d completions (%.2fms%s)", ncands,
+        (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6, note);
+  }
+  last_tick = E.tick;
+  for (char *p = cands[cur] + plen; *p; p++)
+    editorInsertChar(*p);
+  if (ncands > 1)
+    editorSetStatusMessage("Complete: %s (%d/%d)", cands[cur], cur + 1, ncands);
+}
+// カーソル下の括弧の相手に移動する
+void editorJumpToBracket() {
+  int mrow, mrx;
+  erow *row = E.cy < E.numrows ? editorRowAt(E.cy) : NULL;
+  if (row == NULL ||
+      !editorFindBracketMatch(
+          E.cy, editorRenderOffset(row, editorRowCxToRx(row, E.cx)), &mrow,
+          &mrx)) {
+    editorSetStatusMessage("No matching bracket");
+    return;
+  }
+  E.cy = mrow;
+  row = editorRowAt(mrow);
+  E.cx = editorRowRxToCx(row, editorRenderCol(row, mrx));
+}
+// 折り返し表示でのPAGE_UP/PAGE_DOWN。表示行単位で1画面分動かす
+void editorWrapPage(int key) {
+  int total = editorWrapPrefix(E.numrows);
+  int dir = (key == PAGE_UP) ? -E.screenrows : E.screenrows;
+  int cv = editorWrapCursorLine();
+  int target = cv + dir;
+  // 表示行の中での桁は保つ
+  int xoff = E.rx;
+  if (E.cy < E.numrows)
+    xoff -= editorWrapStart(&E.row[E.cy], cv - editorWrapPrefix(E.cy));
+  if (target < 0)
+    target = 0;
+  if (target > total)
+    target = total;
+  E.voff += dir;
+  // 最後のページでは末尾が画面の下端に来るところで止める
+  if (E.voff > total - E.screenrows + 1)
+    E.voff = total - E.screenrows + 1;
+  if (E.voff < 0)
+    E.voff = 0;
+  int sub;
+  int filerow = editorWrapFind(target, &sub);
+  if (filerow >= E.numrows) {
+    E.cy = E.numrows;
+    E.cx = 0;
+    return;
+  }
+  E.cy = filerow;
+  erow *row = editorRowAt(filerow);
+  E.cx = editorRowRxToCx(row, editorWrapStart(row, sub) + xoff);
+}
+/*** multi-cursor ***/
+// 同じ編集を多くの行にまとめて行う。キーごとにカーソルを行でまとめ、
+// 各行は1回の書き換えとeditorUpdateRowで済ませる。ハイライトはマクロの
+// 再生と同じく後回しにし、見えている行から付け直す
+
+void editorMultiAdd(int cy, int cx) {
+  if (E.mc_n == E.mc_cap) {
+    E.mc_cap = E.mc_cap ? E.mc_cap * 2 : 64;
+    E.mc = realloc(E.mc, sizeof(struct cursor) * E.mc_cap);
+  }
+  E.mc[E.mc_n].cy = cy;
+  E.mc[E.mc_n].cx = cx;
+  E.mc_n++;
+}
+int cursorCompare(const void *a, const void *b) {
+  const struct cursor *x = a, *y = b;
+  if (x->cy != y->cy)
+    return x->cy < y->cy ? -1 : 1;
+  return (x->cx > y->cx) - (x->cx < y->cx);
+}
+// 並べ直して重なったカーソルを1つにし、E.cx/E.cyを主カーソルに合わせる
+void editorMultiNormalize(int sorted) {
+  struct cursor main = E.mc[E.mc_main];
+  if (!sorted)
+    qsort(E.mc, E.mc_n, sizeof(struct cursor), cursorCompare);
+  int n = 0;
+  for (int j = 0; j < E.mc_n; j++) {
+    if (n > 0 && !cursorCompare(&E.mc[n - 1], &E.mc[j]))
+      continue;
+    E.mc[n++] = E.mc[j];
+  }
+  E.mc_n = n;
+  E.mc_main = 0;
+  for (int j = 0; j < n; j++) {
+    if (!cursorCompare(&E.mc[j], &main)) {
+      E.mc_main = j;
+      break;
+    }
+  }
+  E.cy = E.mc[E.mc_main].cy;
+  E.cx = E.mc[E.mc_main].cx;
+}
+// 並べ終わったカーソルのうち、今のカーソル以降で最初のものを主カーソルにする
+void editorMultiStart() {
+  E.mc_main = 0;
+  while (E.mc_main < E.mc_n - 1 &&
+         (E.mc[E.mc_main].cy < E.cy ||
+          (E.mc[E.mc_main].cy == E.cy && E.mc[E.mc_main].cx < E.cx)))
+    E.mc_main++;
+  editorMultiNormalize(1);
+  editorSetStatusMessage("%d cursors (ESC to leave)", E.mc_n);
+}
+void editorMultiClear() { E.mc_n = 0; }
+
+// 検索語の一致するすべての位置にカーソルを置く
+void editorMultiMatches() {
+  char *query = editorPrompt("Cursors at matches: %s (ESC to cancel)", NULL);
+  if (query == NULL)
+    return;
+  int qlen = strlen(query);
+  E.mc_n = 0;
+  for (int j = 0; j < E.numrows && qlen; j++) {
+    // 圧縮・追い出しされた行も展開せずに探す
+    char *line = editorRowPeek(&E.row[j]);
+    int size = E.row[j].size;
+    const char *p = line;
+    while ((p = kiloMemmem(p, line + size - p, query, qlen)) != NULL) {
+      editorMultiAdd(j, p - line);
+      p += qlen;
+    }
+  }
+  free(query);
+  if (E.mc_n == 0) {
+    editorSetStatusMessage("No match");
+    return;
+  }
+  editorMultiStart();
+}
+// 今のカーソルの表示桁に、指定した行までの各行にカーソルを置く
+void editorMultiColumn() {
+  if (E.numrows == 0)
+    return;
+  char *line = editorPrompt("Column cursors to line: %s (ESC to cancel)", NULL);
+  if (line == NULL)
+    return;
+  int target = atoi(line) - 1;
+  free(line);
+  if (target < 0)
+    target = 0;
+  if (target >= E.numrows)
+    target = E.numrows - 1;
+  int cy = E.cy < E.numrows ? E.cy : E.numrows - 1;
+  int rx = E.cy < E.numrows ? editorRowCxToRx(editorRowAt(cy), E.cx) : 0;
+  int lo = cy < target ? cy : target;
+  int hi = cy < target ? target : cy;
+  E.mc_n = 0;
+  for (int j = lo; j <= hi; j++)
+    editorMultiAdd(j, editorRowRxToCx(editorRowAt(j), rx));
+  E.cy = cy;
+  E.cx = editorRowRxToCx(&E.row[cy], rx);
+  editorMultiStart();
+}
+
+// すべてのカーソルの位置にcを挿入する。行ごとに1回だけ広げ、後ろから詰め直す
+void editorMultiInsert(int c) {
+  int defer = E.hl_defer;
+  E.hl_defer = 1;
+  for (int i = 0; i < E.mc_n;) {
+    int j = i;
+    while (j < E.mc_n && E.mc[j].cy == E.mc[i].cy)
+      j++;
+    erow *row = editorRowAt(E.mc[i].cy);
+    editorTokenRemoveRow(row);
+    row->chars = realloc(row->chars, row->size + (j - i) + 1);
+    int end = row->size;
+    for (int k = j - 1; k >= i; k--) {
+      int at = E.mc[k].cx;
+      int shift = k - i + 1;
+      memmove(&row->chars[at + shift], &row->chars[at], end - at);
+      row->chars[at + shift - 1] = c;
+      E.mc[k].cx += shift;
+      end = at;
+    }
+    row->size += j - i;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    i = j;
+  }
+  E.hl_defer = defer;
+  E.dirty++;
+  editorMultiNormalize(1);
+}
+// すべてのカーソルの前(forwardなら後ろ)の1文字を消す。行はつながない
+void editorMultiDelete(int forward) {
+  int defer = E.hl_defer;
+  E.hl_defer = 1;
+  for (int i = 0; i < E.mc_n;) {
+    int j = i;
+    while (j < E.mc_n && E.mc[j].cy == E.mc[i].cy)
+      j++;
+    erow *row = editorRowAt(E.mc[i].cy);
+    editorTokenRemoveRow(row);
+    // 消す範囲は隣のカーソルを越えないので、前から1回で詰められる
+    int out = 0, in = 0;
+    for (int k = i; k < j; k++) {
+      int from = E.mc[k].cx, to = from;
+      if (forward && to < row->size) {
+        to++;
+        while (to < row->size && (row->chars[to] & 0xc0) == 0x80)
+          to++;
+      } else if (!forward && from > 0) {
+        from--;
+        while (from > 0 && (row->chars[from] & 0xc0) == 0x80)
+          from--;
       }
+      memmove(&row->chars[out], &row->chars[in], from - in);
+      out += from - in;
+      in = to;
+      E.mc[k].cx = out;
+    }
+    memmove(&row->chars[out], &row->chars[in], row->size - in);
+    row->size = out + row->size - in;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    i = j;
+  }
+  E.hl_defer = defer;
+  E.dirty++;
+  editorMultiNormalize(1);
+}
+// すべてのカーソルを動かす。左右は行の中だけで動く
+void editorMultiMove(int key) {
+  for (int k = 0; k < E.mc_n; k++) {
+    struct cursor *m = &E.mc[k];
+    if (key == ARROW_UP && m->cy > 0)
+      m->cy--;
+    else if (key == ARROW_DOWN && m->cy < E.numrows - 1)
+      m->cy++;
+    erow *row = editorRowAt(m->cy);
+    if (key == ARROW_LEFT && m->cx > 0) {
+      m->cx--;
+      while (m->cx > 0 && (row->chars[m->cx] & 0xc0) == 0x80)
+        m->cx--;
+    } else if (key == ARROW_RIGHT && m->cx < row->size) {
+      m->cx++;
+      while (m->cx < row->size && (row->chars[m->cx] & 0xc0) == 0x80)
+        m->cx++;
+    } else if (key == HOME_KEY) {
+      m->cx = 0;
+    } else if (key == END_KEY) {
+      m->cx = row->size;
+    }
+    if (m->cx > row->size)
+      m->cx = row->size;
+    while (m->cx > 0 && m->cx < row->size &&
+           (row->chars[m->cx] & 0xc0) == 0x80)
+      m->cx--;
+  }
+  editorMultiNormalize(key != ARROW_UP && key != ARROW_DOWN);
+}
+// 複数カーソルのときのキー処理。処理したら1を返す。カーソルの位置を
+// 壊すキーは複数カーソルを解除して通常の処理に回す
+int editorMultiKey(int c) {
+  switch (c) {
+  case '\x1b':
+    editorMultiClear();
+    editorSetStatusMessage("");
+    return 1;
+  case BACK_SPACE:
+  case CTRL_KEY('h'):
+    editorMultiDelete(0);
+    return 1;
+  case DEL_KEY:
+    editorMultiDelete(1);
+    return 1;
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case HOME_KEY:
+  case END_KEY:
+    editorMultiMove(c);
+    return 1;
+  case CTRL_KEY('s'):
+  case CTRL_KEY('l'):
+  case CTRL_KEY('t'):
+  case CTRL_KEY('q'):
+    return 0;
+  }
+  if ((c < 32 && c != '\t') || c > 255) {
+    editorMultiClear();
+    return 0;
+  }
+  editorMultiInsert(c);
+  return 1;
+}
+// 行filerowの最初のカーソルの番号
+int editorMultiFirst(int filerow) {
+  int lo = 0, hi = E.mc_n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.mc[mid].cy < filerow)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+// 行の*k番目以降で次に描くカーソルのrender上の位置(なければ-1)。
+// 主カーソルは端末のカーソルで見えるので飛ばす
+int editorMultiNext(erow *row, int *k) {
+  while (*k < E.mc_n && E.mc[*k].cy == row->idx) {
+    if ((*k)++ == E.mc_main)
+      continue;
+    return editorRenderOffset(row, editorRowCxToRx(row, E.mc[*k - 1].cx));
+  }
+  return -1;
+}
+
+/*** line commands ***/
+// 範囲の行の並べ替え・重複の削除・一致する行の絞り込み。行の中身は動かさず、
+// 行ごとのキー(先頭8バイトと中身へのポインタ)を複数スレッドで並べ替えて
+// から、E.rowを1回だけ組み直す。ハイライトは後回しにして見えている行から付け直す
+
+struct lineKey {
+  uint64_t pre;
+  const char *s;
+  int len;
+  int idx;
+};
+// 並べ替えの向き。スレッドを動かす前に決め、動いている間は読むだけ
+int lineSortReverse;
+
+int lineKeyCompare(const void *a, const void *b) {
+  const struct lineKey *x = a, *y = b;
+  int r = 0;
+  if (x->pre != y->pre) {
+    r = x->pre < y->pre ? -1 : 1;
+  } else {
+    int n = x->len < y->len ? x->len : y->len;
+    r = n > 8 ? memcmp(x->s + 8, y->s + 8, n - 8) : 0;
+    if (r == 0)
+      r = (x->len > y->len) - (x->len < y->len);
+  }
+  if (lineSortReverse)
+    r = -r;
+  // 同じ内容の行は元の順を保つ
+  return r ? r : (x->idx > y->idx) - (x->idx < y->idx);
+}
+// 中身が同じか(idxは見ない)
+int lineKeyEqual(const struct lineKey *x, const struct lineKey *y) {
+  return x->pre == y->pre && x->len == y->len &&
+         (x->len <= 8 || !memcmp(x->s + 8, y->s + 8, x->len - 8));
+}
+
+struct sortJob {
+  struct lineKey *a;
+  struct lineKey *out;
+  int lo, mid, hi;
+  const char *pat;
+  int plen;
+  int want;
+  char *keep;
+};
+void *sortChunkWorker(void *arg) {
+  struct sortJob *j = arg;
+  qsort(j->a + j->lo, j->hi - j->lo, sizeof(struct lineKey), lineKeyCompare);
+  return NULL;
+}
+// a[lo,mid)とa[mid,hi)をout[lo,hi)にまとめる
+void *sortMergeWorker(void *arg) {
+  struct sortJob *j = arg;
+  int p = j->lo, q = j->mid, k = j->lo;
+  while (p < j->mid && q < j->hi) {
+    if (lineKeyCompare(&j->a[q], &j->a[p]) < 0)
+      j->out[k++] = j->a[q++];
+    else
+      j->out[k++] = j->a[p++];
+  }
+  while (p < j->mid)
+    j->out[k++] = j->a[p++];
+  while (q < j->hi)
+    j->out[k++] = j->a[q++];
+  return NULL;
+}
+void *lineFilterWorker(void *arg) {
+  struct sortJob *j = arg;
+  for (int i = j->lo; i < j->hi; i++) {
+    struct lineKey *k = &j->a[i];
+    int hit = kiloMemmem(k->s, k->len, j->pat, j->plen) != NULL;
+    j->keep[i] = hit == j->want;
+  }
+  return NULL;
+}
+int kiloSortThreads(int n) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < KILO_SORT_MIN_PAR || ncpu < 1)
+    return 1;
+  return ncpu > KILO_SORT_THREADS ? KILO_SORT_THREADS : ncpu;
+}
+// jobs[0..n)をfnでそれぞれのスレッドに走らせ、終わるまで待つ
+void kiloRunJobs(void *(*fn)(void *), struct sortJob *jobs, int n) {
+  pthread_t th[KILO_SORT_THREADS];
+  char started[KILO_SORT_THREADS];
+  // スレッドを作れなければその分はこのスレッドでやる
+  for (int t = 1; t < n; t++) {
+    started[t] = pthread_create(&th[t], NULL, fn, &jobs[t]) == 0;
+    if (!started[t])
+      fn(&jobs[t]);
+  }
+  fn(&jobs[0]);
+  for (int t = 1; t < n; t++) {
+    if (started[t])
+      pthread_join(th[t], NULL);
+  }
+}
+// 塊ごとにスレッドでqsortし、隣り合う塊を並行にマージしていく
+void editorSortKeys(struct lineKey *keys, int n) {
+  int nt = kiloSortThreads(n);
+  struct sortJob jobs[KILO_SORT_THREADS];
+  int bounds[KILO_SORT_THREADS + 1];
+  for (int t = 0; t <= nt; t++)
+    bounds[t] = (int)((long long)n * t / nt);
+  for (int t = 0; t < nt; t++) {
+    jobs[t].a = keys;
+    jobs[t].lo = bounds[t];
+    jobs[t].hi = bounds[t + 1];
+  }
+  kiloRunJobs(sortChunkWorker, jobs, nt);
+  struct lineKey *a = keys;
+  struct lineKey *tmp = malloc(sizeof(struct lineKey) * (n + 1));
+  for (int width = 1; width < nt; width *= 2) {
+    int nj = 0;
+    for (int t = 0; t < nt; t += 2 * width) {
+      int mid = t + width < nt ? t + width : nt;
+      int hi = t + 2 * width < nt ? t + 2 * width : nt;
+      jobs[nj].a = a;
+      jobs[nj].out = tmp;
+      jobs[nj].lo = bounds[t];
+      jobs[nj].mid = bounds[mid];
+      jobs[nj].hi = bounds[hi];
+      nj++;
     }
-    close(fd);
+    kiloRunJobs(sortMergeWorker, jobs, nj);
+    struct lineKey *swap = a;
+    a = tmp;
+    tmp = swap;
   }
-  editorSetStatusMessage("Can't save ! I/O error: %s", strerror(errno));
-  free(buf);
+  if (a != keys) {
+    memcpy(keys, a, sizeof(struct lineKey) * n);
+    tmp = a;
+  }
+  free(tmp);
 }
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
-
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+// 行[from,to)のキーを作る。圧縮ブロックは行の並びに依存するので、charsだけを
+// 戻してブロックから外す(ハイライトは並べ直した後に後回しでやる)。追い出された
+// 行だけはファイルから読んだ中身を*arenaに置き、ほかの行はcharsを指す
+struct lineKey *editorLineKeys(int from, int to, char **arena) {
+  size_t lazy = 0;
+  for (int j = from; j < to; j++) {
+    if (E.row[j].cold)
+      editorColdDetach(&E.row[j]);
+    if (E.row[j].chars == NULL)
+      lazy += E.row[j].size;
   }
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
-    return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
-  }
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+  *arena = malloc(lazy + 1);
+  char *p = *arena;
+  struct lineKey *keys = malloc(sizeof(struct lineKey) * (to - from + 1));
+  for (int j = from; j < to; j++) {
+    erow *row = &E.row[j];
+    struct lineKey *k = &keys[j - from];
+    k->s = row->chars;
+    if (k->s == NULL) {
+      memcpy(p, editorRowPeek(row), row->size);
+      k->s = p;
+      p += row->size;
     }
+    k->len = row->size;
+    k->idx = j;
+    k->pre = 0;
+    for (int b = 0; b < 8; b++)
+      k->pre = k->pre << 8 | (b < k->len ? (unsigned char)k->s[b] : 0);
   }
+  return keys;
 }
-void editorFind() {
-  int save_cx = E.cx;
-  int save_cy = E.cy;
-  int save_coloff = E.coloff;
-  int save_rowoff = E.rowoff;
-  char *query =
-      editorPrompt("Search:%s (USE/ESC/Arrows/Enter)", editorFindCallback);
-  if (query) {
-    free(query);
+// 行[from,to)をorder[0..n)の行(元の番号)で置き換える。orderにない行は消す。
+// 行の構造体だけを並べ直し、E.rowとidxは1回で組み直す
+void editorLinesApply(int from, int to, int *order, int n) {
+  char *used = calloc(to - from + 1, 1);
+  for (int k = 0; k < n; k++)
+    used[order[k] - from] = 1;
+  for (int j = from; j < to; j++) {
+    if (used[j - from])
+      continue;
+    editorTokenRemoveRow(&E.row[j]);
+    editorFreeRow(&E.row[j]);
+  }
+  free(used);
+  int numrows = E.numrows - (to - from) + n;
+  erow *rows = malloc(sizeof(erow) * (numrows + 1));
+  memcpy(rows, E.row, sizeof(erow) * from);
+  for (int k = 0; k < n; k++)
+    rows[from + k] = E.row[order[k]];
+  memcpy(&rows[from + n], &E.row[to], sizeof(erow) * (E.numrows - to));
+  free(E.row);
+  E.row = rows;
+  E.numrows = numrows;
+  for (int j = from; j < E.numrows; j++)
+    E.row[j].idx = j;
+  // 並べ直した範囲は保存版との対応を取り直す。ハイライトは範囲とその
+  // 次の行(複数コメントの状態が変わりうる)を後回しにする
+  for (int j = from; j < from + n; j++)
+    E.row[j].bidx = -1;
+  for (int j = from; j <= from + n && j < E.numrows; j++)
+    E.row[j].hl_stale = 1;
+  if (E.hl_lo == -1 || E.hl_lo > from)
+    E.hl_lo = from;
+  if (E.hl_lo >= E.numrows)
+    E.hl_lo = -1;
+  if (E.tok_scan > from)
+    E.tok_scan = from;
+  editorGutterDirty(from, E.numrows);
+  editorWrapInvalidate();
+  editorBracketInvalidate();
+  E.dirty++;
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  E.cx = 0;
+}
+// "[N,M] sort [-r] [-u] | uniq | keep TEXT | drop TEXT"を実行する
+void editorLineCommand() {
+  if (E.hex || E.numrows == 0)
+    return;
+  char *cmd = editorPrompt("Lines [N,M] sort [-r] [-u]|uniq|keep X|drop X: %s",
+                           NULL);
+  if (cmd == NULL)
+    return;
+  int from = 0, to = E.numrows;
+  char *p = cmd;
+  if (isdigit((unsigned char)*p)) {
+    from = strtol(p, &p, 10) - 1;
+    to = from + 1;
+    if (*p == ',')
+      to = strtol(p + 1, &p, 10);
+  }
+  if (from < 0)
+    from = 0;
+  if (to > E.numrows)
+    to = E.numrows;
+  while (*p == ' ')
+    p++;
+  int sort = !strncmp(p, "sort", 4);
+  int uniq = !strncmp(p, "uniq", 4);
+  int keep = !strncmp(p, "keep ", 5);
+  int drop = !strncmp(p, "drop ", 5);
+  if ((!sort && !uniq && !keep && !drop) || from >= to) {
+    editorSetStatusMessage("Unknown lines command: %s", cmd);
+    free(cmd);
+    return;
+  }
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  editorFoldClear();
+  editorMultiClear();
+  int n = to - from;
+  char *arena;
+  struct lineKey *keys = editorLineKeys(from, to, &arena);
+  int *order = malloc(sizeof(int) * (n + 1));
+  int m = 0;
+  if (sort || uniq) {
+    lineSortReverse = sort && strstr(p, "-r") != NULL;
+    editorSortKeys(keys, n);
+    // -uとuniqは同じ内容の並びの最初の行だけを残す
+    int dedup = uniq || strstr(p, "-u") != NULL;
+    for (int k = 0; k < n; k++) {
+      if (dedup && k > 0 && lineKeyEqual(&keys[k], &keys[k - 1]))
+        continue;
+      order[m++] = keys[k].idx;
+    }
+    // uniqは残った行を元の順に戻す
+    if (uniq) {
+      char *kept = calloc(n + 1, 1);
+      for (int k = 0; k < m; k++)
+        kept[order[k] - from] = 1;
+      m = 0;
+      for (int k = 0; k < n; k++)
+        if (kept[k])
+          order[m++] = from + k;
+      free(kept);
+    }
   } else {
-    E.cx = save_cx;
-    E.cy = save_cy;
-    E.coloff = save_coloff;
-    E.rowoff = save_rowoff;
+    char *keepv = malloc(n + 1);
+    int nt = kiloSortThreads(n);
+    struct sortJob jobs[KILO_SORT_THREADS];
+    for (int t = 0; t < nt; t++) {
+      jobs[t].a = keys;
+      jobs[t].lo = (int)((long long)n * t / nt);
+      jobs[t].hi = (int)((long long)n * (t + 1) / nt);
+      jobs[t].pat = p + 5;
+      jobs[t].plen = strlen(p + 5);
+      jobs[t].want = keep;
+      jobs[t].keep = keepv;
+    }
+    kiloRunJobs(lineFilterWorker, jobs, nt);
+    for (int k = 0; k < n; k++)
+      if (keepv[k])
+        order[m++] = from + k;
+    free(keepv);
   }
+  free(keys);
+  free(arena);
+  editorLinesApply(from, to, order, m);
+  free(order);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  editorSetStatusMessage("%s: %d lines -> %d lines in %.3fs (%d threads)", cmd,
+                         n, m, secs, kiloSortThreads(n));
+  free(cmd);
 }
+
 // append buffer
 struct abuf {
   /* data */
@@ -722,6 +5108,88 @@ void abAppend(struct abuf *ab, const char *s, int len) {
   ab->len += len;
 }
 void abFree(struct abuf *ab) { free(ab->b); }
+/*** idle ***/
+// 入力待ちの間に少しずつ進める仕事。優先度の高い順に並べる。
+// stepはdeadline(kiloNowUs)までに一区切り進めて戻り、やることがなければ0を返す
+int editorIdleSyntax(long long deadline) {
+  if (E.hl_lo == -1)
+    return 0;
+  editorSyntaxFlushRange(E.numrows, deadline);
+  return 1;
+}
+// キャッシュから開いた行はハイライトされるまで単語が数えられないので、
+// 展開せずに読んで数えておく
+int editorIdleTokenScan(long long deadline) {
+  if (E.tok_scan < 0)
+    return 0;
+  for (; E.tok_scan < E.numrows; E.tok_scan++) {
+    if ((E.tok_scan & 63) == 0 && kiloNowUs() >= deadline)
+      return 1;
+    erow *row = &E.row[E.tok_scan];
+    if (!row->tok_counted) {
+      editorTokenScan(editorRowPeek(row), row->size, 1);
+      row->tok_counted = 1;
+    }
+  }
+  E.tok_scan = -1;
+  return 1;
+}
+int editorIdleTokens(long long deadline) {
+  if (E.tok_n == E.tok_nsorted)
+    return 0;
+  editorTokenMergeStep(deadline);
+  return 1;
+}
+// 画面の前後の圧縮・追い出しされた行を先に作り直しておく
+int editorIdlePrefetch(long long deadline) {
+  if (E.mem_budget && E.mem_used > E.mem_budget)
+    return 0;
+  int lo = E.rowoff - E.screenrows * 2;
+  int hi = E.rowoff + E.screenrows * 3;
+  if (lo < 0)
+    lo = 0;
+  if (hi > E.numrows)
+    hi = E.numrows;
+  int did = 0;
+  for (int j = lo; j < hi && kiloNowUs() < deadline; j++) {
+    if (E.row[j].cold || E.row[j].render == NULL) {
+      editorRowTouch(&E.row[j]);
+      did = 1;
+    }
+  }
+  return did;
+}
+struct idleTask {
+  const char *name;
+  int (*step)(long long deadline);
+};
+struct idleTask idleTasks[] = {
+    {"syntax", editorIdleSyntax},
+    {"gutter", editorGutterUpdate},
+    {"stream", editorStreamRead},
+    {"tokscan", editorIdleTokenScan},
+    {"tokens", editorIdleTokens},
+    {"prefetch", editorIdlePrefetch},
+};
+#define IDLE_TASKS (sizeof(idleTasks) / sizeof(idleTasks[0]))
+
+// 入力が来ていない間、E.idle_slice_usごとに入力を確かめながら仕事を進める。
+// 入力が来たらすぐ戻り、長く続くときも画面を更新するため区切る。何かしたら1を返す
+int editorIdleRun() {
+  int did = 0;
+  long long frame_end = kiloNowUs() + KILO_IDLE_FRAME_US;
+  while (!editorInputPending() && kiloNowUs() < frame_end) {
+    long long deadline = kiloNowUs() + E.idle_slice_us;
+    int ran = 0;
+    for (unsigned int j = 0; j < IDLE_TASKS && !ran; j++)
+      ran = idleTasks[j].step(deadline);
+    if (!ran)
+      break;
+    did = 1;
+  }
+  return did;
+}
+
 /*** input ***/
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128;
@@ -729,27 +5197,34 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
   size_t buflen = 0;
   buf[0] = '\0';
+  E.prompting = 1;
   while (1) {
     editorSetStatusMessage(prompt, buf);
     editorRefreshScreen();
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACK_SPACE) {
+      // UTF-8の文字はまとめて消す
+      while (buflen != 0 && (buf[buflen - 1] & 0xc0) == 0x80)
+        buflen--;
       if (buflen != 0)
         buf[--buflen] = '\0';
+      buf[buflen] = '\0';
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
       if (callback)
         callback(buf, c);
       free(buf);
+      E.prompting = 0;
       return NULL;
     } else if (c == '\r') {
       if (buflen != 0) {
         editorSetStatusMessage("");
         if (callback)
           callback(buf, c);
+        E.prompting = 0;
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (c < 256 && !iscntrl(c)) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
         buf = realloc(buf, bufsize);
@@ -762,6 +5237,73 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
+void editorToggleRecording() {
+  if (E.replaying)
+    return;
+  if (!E.recording) {
+    E.recording = 1;
+    E.macro_n = 0;
+    editorSetStatusMessage("Recording macro... (Ctrl-K to stop)");
+    return;
+  }
+  // 止めたCtrl-Kは記録に含めない
+  E.recording = 0;
+  E.macro_n--;
+  editorSetStatusMessage("Macro recorded: %d keys", E.macro_n);
+}
+// 記録したマクロをN回、または0ならファイルの最後まで繰り返す。
+// 再生中は画面を描かず、ハイライトは最後にまとめてやり直す
+void editorReplayMacro() {
+  if (E.replaying)
+    return;
+  if (E.recording) {
+    E.recording = 0;
+    E.macro_n--;
+  }
+  if (E.macro_n <= 0) {
+    editorSetStatusMessage("No macro recorded (Ctrl-K to record)");
+    return;
+  }
+  char *times_s =
+      editorPrompt("Replay macro how many times (0 = to end of file): %s", NULL);
+  if (times_s == NULL)
+    return;
+  long times = atol(times_s);
+  free(times_s);
+  if (times <= 0)
+    times = -1;
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  E.replaying = 1;
+  E.hl_defer = 1;
+  long n = 0;
+  while (times < 0 || n < times) {
+    // 最後まで繰り返すときは、カーソルが最終行より後ろに出たら止める
+    if (times < 0 && E.cy >= E.numrows)
+      break;
+    int cy = E.cy;
+    int numrows = E.numrows;
+    E.macro_pos = 0;
+    // 描画はしないが、ページ移動やE.rxが画面の位置に合うようスクロールは毎回する
+    while (E.macro_pos < E.macro_n && E.replaying) {
+      editorProcessKeyPress();
+      ediotorScroll();
+    }
+    n++;
+    editorEnforceBudget();
+    // カーソルもファイルの行数も変わらなくなったら、それ以上進まない
+    if (times < 0 && E.cy == cy && E.numrows == numrows)
+      break;
+  }
+  E.replaying = 0;
+  E.hl_defer = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  long ops = n * E.macro_n;
+  editorSetStatusMessage("Replayed %ld times: %ld keys in %.3fs (%.0f ops/s)",
+                         n, ops, secs, secs > 0 ? ops / secs : 0.0);
+}
 // E.cx/E.cyを変更
 // editorProcessKeyPressで呼び出される
 void editorMoveCursor(int key) {
@@ -771,8 +5313,14 @@ void editorMoveCursor(int key) {
   case ARROW_LEFT:
     if (E.cx != 0) {
       E.cx--;
+      // UTF-8の続きのバイトは飛ばす。ASCIIだけの行は中身を見ずに済む
+      if (!row->ascii) {
+        row = editorRowAt(E.cy);
+        while (E.cx > 0 && (row->chars[E.cx] & 0xc0) == 0x80)
+          E.cx--;
+      }
     } else if (E.cy > 0) {
-      E.cy--;
+      E.cy = editorFoldPrev(E.cy);
       E.cx = E.row[E.cy].size;
     }
     break;
@@ -780,19 +5328,24 @@ void editorMoveCursor(int key) {
   case ARROW_RIGHT:
     if (row && E.cx < row->size) {
       E.cx++;
+      if (!row->ascii) {
+        row = editorRowAt(E.cy);
+        while (E.cx < row->size && (row->chars[E.cx] & 0xc0) == 0x80)
+          E.cx++;
+      }
     } else if (row && E.cx == row->size) {
-      E.cy++;
+      E.cy = editorFoldNext(E.cy);
       E.cx = 0;
     }
     break;
   case ARROW_UP:
     if (E.cy != 0) {
-      E.cy--;
+      E.cy = editorFoldPrev(E.cy);
     }
     break;
   case ARROW_DOWN:
     if (E.cy < E.numrows) {
-      E.cy++;
+      E.cy = editorFoldNext(E.cy);
     }
     break;
   }
@@ -802,16 +5355,30 @@ void editorMoveCursor(int key) {
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  // 文字の途中に入ったら文字の先頭に戻す
+  if (row && !row->ascii) {
+    row = editorRowAt(E.cy);
+    while (E.cx > 0 && E.cx < rowlen && (row->chars[E.cx] & 0xc0) == 0x80)
+      E.cx--;
+  }
 }
 void editorProcessKeyPress() {
   static int quit_times = KILO_QUIT_TIMES;
   int c = editorReadKey();
+  E.tick++;
+  if ((E.mc_n && editorMultiKey(c)) || (E.hex && editorHexKey(c))) {
+    quit_times = KILO_QUIT_TIMES;
+    return;
+  }
   switch (c) {
   case '\r':
-    editorInsertNewline();
+    if (E.grep_results)
+      editorGrepJump();
+    else
+      editorInsertNewline();
     break;
   case CTRL_KEY('q'):
-    if (E.dirty && quit_times > 0) {
+    if (editorAnyDirty() && quit_times > 0 && !E.server) {
       editorSetStatusMessage("Warning!!! File has unsaved changes."
                              "Press Ctrl-Q %d more times to quit",
                              quit_times);
@@ -820,6 +5387,11 @@ void editorProcessKeyPress() {
     }
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
+    // サーバーでは終了せずにクライアントを切り離す。未保存の変更もそのまま残る
+    if (E.server) {
+      E.attached = 0;
+      break;
+    }
     exit(0);
     break;
   case CTRL_KEY('s'):
@@ -839,12 +5411,68 @@ void editorProcessKeyPress() {
   case BACK_SPACE:
   case CTRL_KEY('h'):
   case DEL_KEY:
+    if (editorReadOnly())
+      break;
     if (c == DEL_KEY)
       editorMoveCursor(ARROW_RIGHT);
     editorDelChar();
     break;
+  case CTRL_KEY('g'):
+    editorGotoLine();
+    break;
+  case CTRL_KEY('t'):
+    editorShowMemoryStats();
+    break;
+  case CTRL_KEY('b'):
+    editorJumpToBracket();
+    break;
+  case CTRL_KEY('d'):
+    editorToggleFold();
+    break;
+  case CTRL_KEY('n'):
+    if (!editorReadOnly())
+      editorComplete();
+    break;
+  case CTRL_KEY('o'):
+    editorOpenBuffer();
+    break;
+  case CTRL_KEY('x'):
+    editorSwitchBuffer((E.curbuf + 1) % E.nbufs);
+    break;
+  case CTRL_KEY('r'):
+    editorGrep();
+    break;
+  case CTRL_KEY('k'):
+    editorToggleRecording();
+    break;
+  case CTRL_KEY('e'):
+    editorReplayMacro();
+    break;
+  case CTRL_KEY('a'):
+    if (!editorReadOnly())
+      editorMultiMatches();
+    break;
+  case CTRL_KEY('v'):
+    if (!editorReadOnly())
+      editorMultiColumn();
+    break;
+  case CTRL_KEY('p'):
+    if (!editorReadOnly())
+      editorLineCommand();
+    break;
+  case CTRL_KEY('w'):
+    E.softwrap = !E.softwrap;
+    editorWrapInvalidate();
+    if (editorVisualMap())
+      E.voff = editorWrapPrefix(E.rowoff);
+    editorSetStatusMessage("Soft wrap %s", E.softwrap ? "on" : "off");
+    break;
   case PAGE_UP:
   case PAGE_DOWN: {
+    if (editorVisualMap()) {
+      editorWrapPage(c);
+      break;
+    }
     if (c == PAGE_UP) {
       E.cy = E.rowoff;
     } else if (c == PAGE_DOWN) {
@@ -865,10 +5493,13 @@ void editorProcessKeyPress() {
     editorMoveCursor(c);
     break;
   case CTRL_KEY('l'):
+    editorFrameInvalidate();
+    break;
   case '\x1b':
     break;
   default:
-    editorInsertChar(c);
+    if (!editorReadOnly())
+      editorInsertChar(c);
     break;
   }
   quit_times = KILO_QUIT_TIMES;
@@ -878,29 +5509,124 @@ void editorProcessKeyPress() {
 // E.cx//row[]に対応したindex tabでも一文字
 // E.rx //tabなども考慮してスクリーン上の位置を表す位置
 void ediotorScroll() {
+  if (E.hex) {
+    editorHexScroll();
+    return;
+  }
   E.rx = E.cx;
   // 空行ではない場合
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
-  }
-  // 上にいった場合は上にスクロールする。
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
-  // E.cyが下にはみ出す場合
-  if (E.cy - E.rowoff >= E.screenrows) {
-    // その文だけスクロールする。
-    E.rowoff = E.cy - E.screenrows + 1;
+  // 検索やジャンプで隠れた行に来たら折りたたみを開く
+  while (E.cy < E.numrows && E.row[E.cy].hidden)
+    editorUnfold(editorFoldHeader(E.cy));
+  if (editorVisualMap()) {
+    // 折り返し表示と折りたたみでは表示行単位で縦にスクロールする
+    int cv = editorWrapCursorLine();
+    if (cv < E.voff)
+      E.voff = cv;
+    if (cv - E.voff >= E.screenrows)
+      E.voff = cv - E.screenrows + 1;
+    int sub;
+    E.rowoff = editorWrapFind(E.voff, &sub);
+    // 折り返し表示では横スクロールしない
+    if (E.softwrap) {
+      E.coloff = 0;
+      return;
+    }
+  } else {
+    // 上にいった場合は上にスクロールする。
+    if (E.cy < E.rowoff) {
+      E.rowoff = E.cy;
+    }
+    // E.cyが下にはみ出す場合
+    if (E.cy - E.rowoff >= E.screenrows) {
+      // その文だけスクロールする。
+      E.rowoff = E.cy - E.screenrows + 1;
+    }
   }
 
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
   }
-  if (E.rx - E.coloff >= E.screencols) {
-    E.coloff = E.rx - E.screencols + 1;
+  // カーソル下の全角文字が右端で欠けないようにする
+  int cw = 1;
+  if (E.cy < E.numrows && !E.row[E.cy].ascii && E.cx < E.row[E.cy].size) {
+    unsigned int cp;
+    erow *row = &E.row[E.cy];
+    kiloDecodeUtf8(&row->chars[E.cx], row->size - E.cx, &cp);
+    if (kiloCharWidth(cp) > 1)
+      cw = kiloCharWidth(cp);
+  }
+  if (E.rx + cw - 1 - E.coloff >= E.screencols) {
+    E.coloff = E.rx + cw - E.screencols;
   }
 }
 // output
+// 左端の桁に保存版からの変更の印を出す
+void editorDrawGutter(struct abuf *ab, int mark) {
+  switch (mark) {
+  case GUT_ADD:
+    abAppend(ab, "\x1b[32m+\x1b[39m", 11);
+    break;
+  case GUT_CHANGE:
+    abAppend(ab, "\x1b[33m*\x1b[39m", 11);
+    break;
+  case GUT_DEL:
+    abAppend(ab, "\x1b[31m-\x1b[39m", 11);
+    break;
+  default:
+    abAppend(ab, " ", 1);
+  }
+}
+// 16進表示の行頭のオフセット欄をbufに書き、その幅を返す。1TiB以上では欄が広がる
+int editorHexOffset(char *buf, size_t size, off_t off) {
+  return snprintf(buf, size, "%010llx  ", (unsigned long long)off);
+}
+// 16進表示の1行: オフセット、16バイトの16進、文字。書き換えたバイトは赤、
+// カーソルのバイトは文字の側を反転する
+void editorDrawHexRow(struct abuf *ab, off_t off) {
+  struct hexView *h = E.hex;
+  char line[128];
+  unsigned char mark[128];
+  int len = editorHexOffset(line, sizeof(line), off);
+  memset(mark, 0, sizeof(mark));
+  int text = len + KILO_HEX_COLS * 3 + 2;
+  memset(line + len, ' ', text + KILO_HEX_COLS - len);
+  for (int i = 0; i < KILO_HEX_COLS && off + i < h->size; i++) {
+    int patched;
+    unsigned char b = editorHexByte(off + i, &patched);
+    int x = len + i * 3 + (i >= KILO_HEX_COLS / 2);
+    line[x] = "0123456789abcdef"[b >> 4];
+    line[x + 1] = "0123456789abcdef"[b & 15];
+    line[text + i] = isprint(b) ? b : '.';
+    if (patched)
+      mark[x] = mark[x + 1] = mark[text + i] = 1;
+    if (off + i == h->cur)
+      mark[text + i] |= 2;
+  }
+  len = text + KILO_HEX_COLS;
+  if (len > E.screencols)
+    len = E.screencols;
+  for (int x = 0; x < len; x++) {
+    if (mark[x] & 1)
+      abAppend(ab, "\x1b[31m", 5);
+    if (mark[x] & 2)
+      abAppend(ab, "\x1b[7m", 4);
+    abAppend(ab, &line[x], 1);
+    if (mark[x])
+      abAppend(ab, "\x1b[m", 3);
+  }
+}
+// 16進表示のときのカーソルの画面上の桁
+int editorHexCursorCol() {
+  int i = E.hex->cur % KILO_HEX_COLS;
+  int x = editorHexOffset(NULL, 0, E.hex->cur - i) + i * 3 +
+          (i >= KILO_HEX_COLS / 2) + E.hex->nib;
+  return x < E.screencols ? x : E.screencols - 1;
+}
+
 // 行を書いていく
 // y:現在の行index
 // 1
@@ -910,12 +5636,39 @@ void ediotorScroll() {
 // abを受取り、E.の内容を反映させる。
 void editorDrawRows(struct abuf *ab) {
   int y;
+  if (E.hex) {
+    for (y = 0; y < E.screenrows; y++) {
+      off_t off = E.hex->top + (off_t)y * KILO_HEX_COLS;
+      editorDrawGutter(ab, GUT_NONE);
+      if (off < E.hex->size)
+        editorDrawHexRow(ab, off);
+      abAppend(ab, "\x1b[K", 3);
+      abAppend(ab, "\r\n", 2);
+    }
+    return;
+  }
+  int visual = editorVisualMap();
+  int tail = 0;
   for (y = 0; y < E.screenrows; y++) { // 1スクリーンの最下部まで繰り返す
     // 実際のファイルの何行目かを表す
     int filerow = y + E.rowoff;
+    int start = E.coloff;
+    int sub = 0;
+    // 折り返し表示と折りたたみでは表示行ごとに木を引き、隠れた行を飛ばす
+    if (visual) {
+      filerow = editorWrapFind(E.voff + y, &sub);
+      if (E.softwrap && filerow < E.numrows)
+        start = editorWrapStart(editorRowAt(filerow), sub);
+    }
     // ファイルの最下部以下のとき
     if (filerow >= E.numrows) { // ファイルの最下部より下からの範囲
-      //
+      // 左端の桁にはチルダ。末尾の行が消されていれば最初の行に印を出す
+      if (E.gut_tail && !tail) {
+        editorDrawGutter(ab, E.gut_tail);
+        tail = 1;
+      } else {
+        abAppend(ab, "~", 1);
+      }
       if (E.numrows == 0 &&
           y ==
               E.screenrows /
@@ -928,30 +5681,57 @@ void editorDrawRows(struct abuf *ab) {
           welcomelen = E.screencols;   // 長さを列の長さに落とす
         int padding = (E.screencols - welcomelen) /
                       2; // 列とmsgの長さの差をpaddingとする（左側だけなので1/2)
-        if (padding) {          // paddingがあるなら
-          abAppend(ab, "~", 1); // 左端にはチルダ（共通)
-          padding--;
-        }
         while (padding--)       // 左端を覗いたpaddingに空白
           abAppend(ab, " ", 1); // 空白で埋める
         abAppend(ab, welcome, welcomelen);
-      } else { // ファイルが存在する、または、列の1/3の位置でないとき、左端にはチルダだけ表示
-        abAppend(ab, "~", 1);
       }
     } else { // ファイルの最下部までの範囲
              // 単純にファイルを描画する
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
+      erow *row = editorRowAt(filerow);
+      char *c = row->render;
+      unsigned char *hl = row->hl;
+      editorDrawGutter(ab, sub == 0 && !E.grep_results ? row->gut : GUT_NONE);
+      // startは表示桁。ASCIIの行ならそのままrenderの位置になる
+      int j = editorRenderOffset(row, start);
+      int width = 0;
+      if (!row->ascii && j < row->rsize && editorRenderCol(row, j) < start) {
+        // 全角文字の途中から始まるときは見えている半分を空白にする
+        unsigned int cp;
+        int n = kiloDecodeUtf8(&c[j], row->rsize - j, &cp);
+        width = editorRenderCol(row, j) + kiloCharWidth(cp) - start;
+        abAppend(ab, " ", 1);
+        j += n;
+      }
       int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+      // 主カーソル以外のカーソルの位置
+      int mk = editorMultiFirst(filerow);
+      int mrx = editorMultiNext(row, &mk);
+      while (j < row->rsize) {
+        unsigned int cp = (unsigned char)c[j];
+        int n = 1;
+        int w = 1;
+        if (cp >= 0x80) {
+          n = kiloDecodeUtf8(&c[j], row->rsize - j, &cp);
+          w = kiloCharWidth(cp);
+        }
+        // 行末に収まらない全角文字は描かない
+        if (width + w > E.screencols)
+          break;
+        width += w;
+        while (mrx != -1 && mrx < j)
+          mrx = editorMultiNext(row, &mk);
+        // C1制御文字(U+0080..U+009F)も端末が解釈するのでそのまま出さない
+        int ctrl = cp < 0x80 ? iscntrl(cp)
+                             : (cp < 0xa0 || (cp == 0xfffd && n == 1));
+        // カーソル下の括弧とその相手、ほかのカーソルは反転表示する
+        if (!ctrl && (j == mrx || (filerow == E.br_row[0] && j == E.br_rx[0]) ||
+                      (filerow == E.br_row[1] && j == E.br_rx[1]))) {
+          abAppend(ab, "\x1b[7m", 4);
+          abAppend(ab, &c[j], n);
+          abAppend(ab, "\x1b[27m", 5);
+        } else if (ctrl) {
+          // 制御文字と不正なUTF-8は反転表示の記号にする
+          char sym = (cp <= 26) ? '@' + cp : '?';
           abAppend(ab, "\x1b[7m", 4);
           abAppend(ab, &sym, 1);
           abAppend(ab, "\x1b[m", 3);
@@ -966,7 +5746,7 @@ void editorDrawRows(struct abuf *ab) {
             abAppend(ab, "\x1b[39m", 5);
             current_color = -1;
           }
-          abAppend(ab, &c[j], 1);
+          abAppend(ab, &c[j], n);
         } else {
           int color = editorSyntaxToColor(hl[j]);
           if (color != current_color) {
@@ -975,10 +5755,27 @@ void editorDrawRows(struct abuf *ab) {
             int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
             abAppend(ab, buf, clen);
           }
-          abAppend(ab, &c[j], 1);
+          abAppend(ab, &c[j], n);
         }
+        j += n;
       }
+      while (mrx != -1 && mrx < j)
+        mrx = editorMultiNext(row, &mk);
+      // 行末のカーソル
+      if (j == row->rsize && mrx == j && width < E.screencols)
+        abAppend(ab, "\x1b[7m \x1b[27m", 10);
       abAppend(ab, "\x1b[39m", 5);
+      // 畳んだ見出し行の最後の表示行に隠れた行数を出す
+      if (row->folded && sub == editorVisualLines(row) - 1 &&
+          width < E.screencols) {
+        char fold[32];
+        int flen = snprintf(fold, sizeof(fold), " +%d lines ", row->folded);
+        if (flen > E.screencols - width)
+          flen = E.screencols - width;
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, fold, flen);
+        abAppend(ab, "\x1b[m", 3);
+      }
     }
     // カーソルの右側を削除
     abAppend(ab, "\x1b[K", 3);
@@ -988,19 +5785,33 @@ void editorDrawRows(struct abuf *ab) {
 void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
+  const char *state = E.stream_fd != -1 ? "(reading)"
+                      : E.dirty           ? "(modified)"
+                                          : "";
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
+                     E.filename ? E.filename : "[No Name]", E.numrows, state);
+  if (E.nbufs > 1)
+    len = snprintf(status, sizeof(status), "[%d/%d] %.20s - %d lines %s",
+                   E.curbuf + 1, E.nbufs, E.filename ? E.filename : "[No Name]",
+                   E.numrows, state);
 
   int rlen =
       snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
                E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-  if (E.screencols < len) {
-    len = E.screencols;
+  if (E.hex) {
+    len = snprintf(status, sizeof(status), "%.20s - %lld bytes %s",
+                   E.filename, (long long)E.hex->size, state);
+    rlen = snprintf(rstatus, sizeof(rstatus), "hex | 0x%llx",
+                    (unsigned long long)E.hex->cur);
+  }
+  // バーは印の桁も使う
+  int cols = E.screencols + KILO_GUTTER;
+  if (cols < len) {
+    len = cols;
   }
   abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
+  while (len < cols) {
+    if (cols - len == rlen) {
       abAppend(ab, rstatus, rlen);
       break;
     } else {
@@ -1014,27 +5825,113 @@ void editorDrawStatusBar(struct abuf *ab) {
 void editorDrawMessageBar(struct abuf *ab) {
   abAppend(ab, "\x1b[K", 3);
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols)
-    msglen = E.screencols;
+  if (msglen > E.screencols + KILO_GUTTER)
+    msglen = E.screencols + KILO_GUTTER;
   if (msglen && time(NULL) - E.statusmsg_time < 5) {
     abAppend(ab, E.statusmsg, msglen);
   }
 }
+// SIGWINCHを受けたら画面サイズを取り直す。折り返しの索引は次に使うときに作り直される
+void editorCheckResize() {
+  if (!E.resized)
+    return;
+  E.resized = 0;
+  if (getWindowsSize(&E.screenrows, &E.screencols) == -1)
+    die("getWindowSize");
+  E.screenrows -= 2;
+  E.screencols -= KILO_GUTTER;
+  editorFrameInvalidate();
+}
+// 次の描画で全部の行を書き直させる
+void editorFrameInvalidate() {
+  for (int j = 0; j < E.frame_n; j++)
+    abFree(&E.frame[j]);
+  free(E.frame);
+  E.frame = NULL;
+  E.frame_n = 0;
+}
+// 描いた画面を"\r\n"で行に分けて前回と比べ、変わった行だけをabに書き出す。
+// 各行は色を戻して行末を消して終わるので、どの行からでも書き直せる
+void editorFlushFrame(struct abuf *frame, struct abuf *ab) {
+  int n = 1;
+  for (int j = 0; j + 1 < frame->len; j++) {
+    if (frame->b[j] == '\r' && frame->b[j + 1] == '\n')
+      n++;
+  }
+  if (n != E.frame_n) {
+    editorFrameInvalidate();
+    E.frame = calloc(n, sizeof(struct abuf));
+    E.frame_n = n;
+    for (int j = 0; j < n; j++)
+      E.frame[j].len = -1;
+  }
+  char *p = frame->b;
+  char *end = frame->b + frame->len;
+  for (int y = 0; y < n; y++) {
+    char *e = p;
+    while (e < end && !(e[0] == '\r' && e + 1 < end && e[1] == '\n'))
+      e++;
+    int len = e - p;
+    struct abuf *old = &E.frame[y];
+    if (old->len != len || memcmp(old->b, p, len) != 0) {
+      char buf[32];
+      int blen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+      abAppend(ab, buf, blen);
+      abAppend(ab, p, len);
+      old->b = realloc(old->b, len ? len : 1);
+      memcpy(old->b, p, len);
+      old->len = len;
+    }
+    p = e + 2;
+  }
+}
 void editorRefreshScreen() {
+  // マクロの再生中は描かない
+  if (E.replaying)
+    return;
+  editorCheckResize();
   ediotorScroll();
+  // 後回しにしたハイライトは画面に出る行の分だけ済ませ、残りは入力待ちの間にやる
+  if (E.hl_lo != -1) {
+    int sub;
+    int first = editorVisualMap() ? editorWrapFind(E.voff, &sub) : E.rowoff;
+    int last = editorVisualMap() ? editorWrapFind(E.voff + E.screenrows, &sub)
+                                 : E.rowoff + E.screenrows;
+    editorSyntaxFlushView(first, last);
+  }
+  editorUpdateBracketMatch();
   struct abuf ab = ABUF_INIT;
+  struct abuf frame = ABUF_INIT;
   //
   abAppend(&ab, "\x1b[?25l", 6); // カーソルを非表示を解除sfa
-  abAppend(&ab, "\x1b[H", 3);    // 左上にカーソルを移動する
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  editorDrawRows(&frame);
+  editorDrawStatusBar(&frame);
+  editorDrawMessageBar(&frame);
+  // 前回から変わった行だけを送る
+  editorFlushFrame(&frame, &ab);
+  abFree(&frame);
   char buf[32];
   // CSI cy+1;cx+1 H
   // カーソルの位置にカーソルを表示
   // このカーソル表示は現在のウィンドウから計算されるのでこちら側からの調整は跡からできないため、ここで適切な相対位置を設定
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
+  if (E.hex) {
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+             (int)((E.hex->cur - E.hex->top) / KILO_HEX_COLS) + 1,
+             editorHexCursorCol() + KILO_GUTTER + 1);
+  } else if (E.softwrap) {
+    int cv = editorWrapCursorLine();
+    int cx = E.rx;
+    if (E.cy < E.numrows)
+      cx -= editorWrapStart(&E.row[E.cy], cv - editorWrapPrefix(E.cy));
+    if (cx >= E.screencols)
+      cx = E.screencols - 1;
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (cv - E.voff) + 1,
+             cx + KILO_GUTTER + 1);
+  } else {
+    int cv = E.nfolds ? editorWrapCursorLine() - E.voff : E.cy - E.rowoff;
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cv + 1,
+             (E.rx - E.coloff) + KILO_GUTTER + 1);
+  }
   abAppend(&ab, buf, strlen(buf));
   // CSI 25 h (カーソルを非表示)
   abAppend(&ab, "\x1b[?25h", 6);
@@ -1051,30 +5948,313 @@ void editorSetStatusMessage(const char *fmt, ...) {
   E.statusmsg_time = time(NULL);
 }
 /*** init ***/
+// "64M"のようにK/M/Gの接尾辞を付けられるバイト数を読む
+size_t parseSize(const char *s) {
+  char *end;
+  size_t n = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'g':
+  case 'G':
+    n *= 1024;
+    /* fall through */
+  case 'm':
+  case 'M':
+    n *= 1024;
+    /* fall through */
+  case 'k':
+  case 'K':
+    n *= 1024;
+  }
+  return n;
+}
+void handleSigWinch(int sig) {
+  (void)sig;
+  E.resized = 1;
+}
 void initEditor() {
-  E.cx = 0;
-  E.cy = 0;
-  E.rx = 0;
-  E.rowoff = 0;
-  E.coloff = 0;
-  E.numrows = 0;
-  E.dirty = 0;
-  E.row = NULL;
-  E.filename = NULL;
+  editorBufferReset();
+  E.bufs = malloc(sizeof(struct editorBuffer));
+  E.nbufs = 1;
+  E.curbuf = 0;
+  E.grep = NULL;
+  E.attached = 0;
+  E.in_len = 0;
+  E.in_pos = 0;
+  E.frame = NULL;
+  E.frame_n = 0;
+  E.macro = NULL;
+  E.macro_n = 0;
+  E.macro_cap = 0;
+  E.macro_pos = 0;
+  E.recording = 0;
+  E.replaying = 0;
+  E.hl_defer = 0;
+  E.hl_lo = -1;
+  E.mc = NULL;
+  E.mc_n = 0;
+  E.mc_cap = 0;
+  E.mc_main = 0;
+  E.idle_slice_us = KILO_IDLE_SLICE_US;
+  char *slice = getenv("KILO_LATENCY_BUDGET");
+  if (slice && atoll(slice) > 0)
+    E.idle_slice_us = atoll(slice);
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
-  E.syntax = NULL;
+  E.prompting = 0;
+  E.resized = 0;
+  E.mem_used = 0;
+  E.mem_budget = 0;
+  // 0なら圧縮しない
+  char *budget = getenv("KILO_MEMORY_BUDGET");
+  if (budget)
+    E.mem_budget = parseSize(budget);
+  E.tick = 0;
+  E.cold_blocks = 0;
+  E.cold_ids = 0;
+  E.cold_raw = 0;
+  E.cold_bytes = 0;
+  E.thaws = 0;
+  E.thaw_total_us = 0;
+  E.thaw_max_us = 0;
+  E.br_row[0] = E.br_row[1] = -1;
   if (getWindowsSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
+  // ステータスバーとメッセージバーの2行、変更の印の桁を除く
   E.screenrows -= 2;
+  E.screencols -= KILO_GUTTER;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigWinch;
+  sigaction(SIGWINCH, &sa, NULL);
+}
+/*** server ***/
+// 常駐サーバーのソケット。KILO_SOCKETで変えられる
+char *kiloSocketPath() {
+  static char path[108];
+  char *env = getenv("KILO_SOCKET");
+  if (env)
+    snprintf(path, sizeof(path), "%s", env);
+  else
+    snprintf(path, sizeof(path), "/tmp/kilo-%d.sock", (int)getuid());
+  return path;
+}
+int kiloConnect() {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", kiloSocketPath());
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+// 接続してきたクライアントに、頼まれたファイルのバッファを表示する。
+// 最初に"行数 桁数 絶対パス\n"が届く(パスは空でもいい)
+int editorAttach(int conn) {
+  char hello[4096 + 32];
+  unsigned int len = 0;
+  while (len < sizeof(hello) - 1) {
+    if (read(conn, &hello[len], 1) != 1)
+      return -1;
+    if (hello[len] == '\n')
+      break;
+    len++;
+  }
+  hello[len] = '\0';
+  int rows, cols, pos = 0;
+  if (sscanf(hello, "%d %d %n", &rows, &cols, &pos) != 2 || rows < 3 ||
+      cols < 1)
+    return -1;
+  char *path = &hello[pos];
+
+  dup2(conn, STDIN_FILENO);
+  dup2(conn, STDOUT_FILENO);
+  E.attached = 1;
+  E.in_len = 0;
+  E.in_pos = 0;
+  E.client_rows = rows;
+  E.client_cols = cols;
+  E.resized = 1;
+  editorFrameInvalidate();
+
+  if (path[0]) {
+    // 読み込み済みならそのバッファを見せるだけ
+    int found = -1;
+    for (int j = 0; j < E.nbufs; j++) {
+      char *name = j == E.curbuf ? E.filename : E.bufs[j].filename;
+      if (name && strcmp(name, path) == 0)
+        found = j;
+    }
+    if (found != -1) {
+      editorSwitchBuffer(found);
+    } else {
+      if (E.filename || E.numrows || E.dirty)
+        editorNewBuffer();
+      if (access(path, R_OK) == 0) {
+        editorOpen(path);
+      } else {
+        // まだないファイルは保存したときに作られる
+        E.filename = strdup(path);
+        editorSelectSyntaxHighlight();
+      }
+    }
+  }
+  editorCheckFileChange();
+  return 0;
+}
+// 切り離したあとの標準入出力は/dev/nullにしておく
+void editorDetach() {
+  int null = open("/dev/null", O_RDWR);
+  dup2(null, STDIN_FILENO);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+  E.attached = 0;
+}
+// バッファを読み込んだまま常駐し、接続してきたクライアントを1つずつ相手にする
+int editorServe() {
+  char *path = kiloSocketPath();
+  int fd = kiloConnect();
+  if (fd != -1) {
+    fprintf(stderr, "kilo: a server is already listening on %s\n", path);
+    return 1;
+  }
+  unlink(path);
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  mode_t mask = umask(077);
+  if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(lfd, 8) == -1) {
+    perror("kilo: listen");
+    return 1;
+  }
+  umask(mask);
+  // 切断されたクライアントへの書き込みで落ちないようにする
+  signal(SIGPIPE, SIG_IGN);
+  E.server = 1;
+  E.client_rows = 24;
+  E.client_cols = 80;
+  editorDetach();
+  initEditor();
+  for (;;) {
+    int conn = accept(lfd, NULL, NULL);
+    if (conn == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("kilo: accept");
+      return 1;
+    }
+    if (editorAttach(conn) == 0) {
+      while (E.attached) {
+        editorRefreshScreen();
+        editorProcessKeyPress();
+        editorEnforceBudget();
+      }
+    }
+    editorDetach();
+    close(conn);
+  }
+}
+
+// 端末とサーバーの間でバイトを中継するだけの薄いクライアント
+int kiloAttach(char *filename) {
+  int fd = kiloConnect();
+  if (fd == -1) {
+    fprintf(stderr, "kilo: no server on %s (start one with kilo --server)\n",
+            kiloSocketPath());
+    return 1;
+  }
+  char path[4096] = "";
+  if (filename && filename[0] != '/') {
+    char cwd[2048];
+    if (getcwd(cwd, sizeof(cwd)))
+      snprintf(path, sizeof(path), "%s/%s", cwd, filename);
+  } else if (filename) {
+    snprintf(path, sizeof(path), "%s", filename);
+  }
+  int rows = 24, cols = 80;
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0) {
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigWinch;
+  sigaction(SIGWINCH, &sa, NULL);
+  enableRawMode();
+  char hello[4096 + 32];
+  int hlen = snprintf(hello, sizeof(hello), "%d %d %s\n", rows, cols, path);
+  if (write(fd, hello, hlen) != hlen)
+    return 1;
+
+  char buf[4096];
+  char esc[sizeof(buf) * 2];
+  for (;;) {
+    if (E.resized) {
+      E.resized = 0;
+      if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1) {
+        unsigned char msg[6] = {0xff, 'W', ws.ws_row >> 8, ws.ws_row & 0xff,
+                                ws.ws_col >> 8, ws.ws_col & 0xff};
+        write(fd, msg, sizeof(msg));
+      }
+    }
+    struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    if (pfd[0].revents & POLLIN) {
+      ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+      int m = 0;
+      for (ssize_t j = 0; j < n; j++) {
+        if ((unsigned char)buf[j] == 0xff)
+          esc[m++] = (char)0xff;
+        esc[m++] = buf[j];
+      }
+      if (m > 0 && write(fd, esc, m) != m)
+        return 1;
+    }
+    if (pfd[1].revents & (POLLIN | POLLHUP)) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0)
+        return 0;
+      write(STDOUT_FILENO, buf, n);
+    }
+  }
 }
+
 int main(int argc, char *argv[]) {
+  if (argc >= 2 && strcmp(argv[1], "--server") == 0)
+    return editorServe();
+  if (argc >= 2 && strcmp(argv[1], "--attach") == 0)
+    return kiloAttach(argc >= 3 ? argv[2] : NULL);
 
+  // "-"なら標準入力を読み込み、キーは制御端末から受け取る
+  int stream = -1;
+  if (argc >= 2 && strcmp(argv[1], "-") == 0)
+    stream = kiloStdinToTty();
   enableRawMode();
   initEditor();
-  if (argc >= 2) {
+  if (stream != -1) {
+    editorStreamOpen(stream);
+  } else if (argc >= 2 && strcmp(argv[1], "-") != 0) {
     editorOpen(argv[1]);
   }
+  // 残りのファイルは裏のバッファに開く
+  for (int j = 2; j < argc; j++) {
+    editorNewBuffer();
+    editorOpen(argv[j]);
+  }
+  if (argc > 2)
+    editorSwitchBuffer(0);
 
   editorSetStatusMessage("HELP:Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
   while (1) {
@@ -1083,6 +6263,7 @@ int main(int argc, char *argv[]) {
     //->(key=editorReadKey editorMoveCursor(key))
     // editorMoveCursorはE.cx/cyを操作する。
     editorProcessKeyPress();
+    editorEnforceBudget();
   }
 
   return 0;